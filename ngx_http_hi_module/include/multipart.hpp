@@ -0,0 +1,276 @@
+#ifndef MULTIPART_HPP
+#define MULTIPART_HPP
+
+#include <cctype>
+#include <cstring>
+#include <string>
+#include <functional>
+#include "string_view.hpp"
+#include "request_view.hpp"
+
+namespace hi {
+
+    /*
+     * An incremental multipart/form-data parser. The body can be fed in
+     * pieces of any size, the data of a part is handed to on_data as it
+     * comes and points into the fed piece, nothing but the part headers
+     * is kept.
+     */
+    class multipart {
+    public:
+
+        struct part {
+            std::string name, filename, content_type;
+        };
+
+        typedef std::function<void(const part&) > part_fn;
+        typedef std::function<void(const part&, const string_view&) > data_fn;
+
+        multipart(const string_view& boundary, const part_fn& on_begin, const data_fn& on_data, const part_fn& on_end) :
+        delimiter("\r\n--" + boundary.to_string())
+        , state(preamble)
+        , matched(2)
+        , header()
+        , current()
+        , on_begin(on_begin)
+        , on_data(on_data)
+        , on_end(on_end) {
+        }
+
+        virtual~multipart() = default;
+
+        /*
+         * Returns false once the body turned out to be malformed.
+         */
+        bool feed(const string_view& chunk) {
+            const char* p = chunk.data();
+            size_t i = 0, n = chunk.size();
+            while (i < n) {
+                switch (this->state) {
+                    case preamble:
+                    case body:
+                        i = this->scan(p, i, n);
+                        break;
+                    case after_delimiter:
+                        if (p[i] == '-') {
+                            this->state = after_dash;
+                        } else if (p[i] == '\r') {
+                            this->state = after_cr;
+                        } else if (p[i] != ' ' && p[i] != '\t') {
+                            this->state = failed;
+                        }
+                        ++i;
+                        break;
+                    case after_dash:
+                        this->state = p[i++] == '-' ? epilogue : failed;
+                        break;
+                    case after_cr:
+                        this->state = p[i++] == '\n' ? headers : failed;
+                        this->header.clear();
+                        break;
+                    case headers:
+                        this->header.push_back(p[i++]);
+                        if (this->header == "\r\n" || (this->header.size() >= 4
+                                && this->header.compare(this->header.size() - 4, 4, "\r\n\r\n") == 0)) {
+                            this->parse_header();
+                            this->state = body;
+                            if (this->on_begin) {
+                                this->on_begin(this->current);
+                            }
+                        } else if (this->header.size() > 16384) {
+                            this->state = failed;
+                        }
+                        break;
+                    case epilogue:
+                        return true;
+                    default:
+                        return false;
+                }
+            }
+            return this->state != failed;
+        }
+
+        // true once the closing delimiter has been seen
+        bool done()const {
+            return this->state == epilogue;
+        }
+
+        static std::string boundary(const string_view& content_type) {
+            return param(content_type, "boundary");
+        }
+
+        /*
+         * The value of key in a header value like
+         * form-data; name="a"; filename="b".
+         */
+        static std::string param(const string_view& value, const char* key) {
+            size_t start = 0, len = strlen(key);
+            while (start < value.size()) {
+                size_t end = start;
+                bool quoted = false;
+                while (end < value.size() && (quoted || value[end] != ';')) {
+                    if (value[end] == '"') {
+                        quoted = !quoted;
+                    } else if (quoted && value[end] == '\\') {
+                        ++end;
+                    }
+                    ++end;
+                }
+                string_view item = trim(value.substr(start, end - start));
+                size_t eq = item.find('=');
+                if (eq != string_view::npos) {
+                    string_view k = trim(item.substr(0, eq));
+                    if (k.size() == len && strncasecmp(k.data(), key, len) == 0) {
+                        return unquote(trim(item.substr(eq + 1)));
+                    }
+                }
+                start = end + 1;
+            }
+            return std::string();
+        }
+
+    private:
+
+        enum state_t {
+            preamble, after_delimiter, after_dash, after_cr, headers, body, epilogue, failed
+        };
+
+        static string_view trim(string_view str) {
+            const char *b = str.begin(), *e = str.end();
+            while (b != e && isspace((unsigned char) *b)) {
+                ++b;
+            }
+            while (e != b && isspace((unsigned char) e[-1])) {
+                --e;
+            }
+            return string_view(b, e - b);
+        }
+
+        static std::string unquote(const string_view& str) {
+            if (str.size() < 2 || str[0] != '"' || str[str.size() - 1] != '"') {
+                return str.to_string();
+            }
+            std::string result;
+            for (size_t i = 1; i + 1 < str.size(); ++i) {
+                if (str[i] == '\\' && i + 2 < str.size()) {
+                    ++i;
+                }
+                result.push_back(str[i]);
+            }
+            return result;
+        }
+
+        /*
+         * Looks for the delimiter in p[i, n). A '\r' only starts the
+         * delimiter, so a partial match that fails can be passed on as data
+         * as a whole, and a match cut off by the end of the piece is kept
+         * as the count of delimiter bytes seen.
+         */
+        size_t scan(const char* p, size_t i, size_t n) {
+            const std::string& d = this->delimiter;
+            if (this->matched > 0) {
+                size_t m = 0;
+                while (this->matched + m < d.size() && i + m < n && p[i + m] == d[this->matched + m]) {
+                    ++m;
+                }
+                if (this->matched + m == d.size()) {
+                    this->found();
+                    return i + m;
+                }
+                if (i + m == n) {
+                    this->matched += m;
+                    return n;
+                }
+                this->emit(d.data(), this->matched);
+                this->matched = 0;
+            }
+            size_t start = i;
+            while (i < n) {
+                const char* cr = (const char*) memchr(p + i, '\r', n - i);
+                if (cr == NULL) {
+                    break;
+                }
+                size_t j = cr - p, m = 0;
+                while (m < d.size() && j + m < n && p[j + m] == d[m]) {
+                    ++m;
+                }
+                if (m == d.size()) {
+                    this->emit(p + start, j - start);
+                    this->found();
+                    return j + m;
+                }
+                if (j + m == n) {
+                    this->emit(p + start, j - start);
+                    this->matched = m;
+                    return n;
+                }
+                i = j + 1;
+            }
+            this->emit(p + start, n - start);
+            return n;
+        }
+
+        void emit(const char* data, size_t n) {
+            if (this->state == body && n > 0 && this->on_data) {
+                this->on_data(this->current, string_view(data, n));
+            }
+        }
+
+        void found() {
+            if (this->state == body && this->on_end) {
+                this->on_end(this->current);
+            }
+            this->matched = 0;
+            this->state = after_delimiter;
+        }
+
+        void parse_header() {
+            this->current = part();
+            size_t start = 0, end;
+            while ((end = this->header.find("\r\n", start)) != std::string::npos) {
+                string_view line(this->header.data() + start, end - start);
+                start = end + 2;
+                size_t colon = line.find(':');
+                if (colon == string_view::npos) {
+                    continue;
+                }
+                string_view key = trim(line.substr(0, colon)), value = trim(line.substr(colon + 1));
+                if (key.size() == 19 && strncasecmp(key.data(), "Content-Disposition", 19) == 0) {
+                    this->current.name = param(value, "name");
+                    this->current.filename = param(value, "filename");
+                } else if (key.size() == 12 && strncasecmp(key.data(), "Content-Type", 12) == 0) {
+                    this->current.content_type = value.to_string();
+                }
+            }
+        }
+
+        std::string delimiter;
+        state_t state;
+        size_t matched;
+        std::string header;
+        part current;
+        part_fn on_begin;
+        data_fn on_data;
+        part_fn on_end;
+    };
+
+    /*
+     * Runs a multipart/form-data request body through the parser piece by
+     * piece, without joining it first.
+     */
+    inline bool read_multipart(request_view& req, const multipart::part_fn& on_begin, const multipart::data_fn& on_data, const multipart::part_fn& on_end) {
+        std::string boundary = multipart::boundary(req.content_type());
+        if (boundary.empty()) {
+            return false;
+        }
+        multipart parser(boundary, on_begin, on_data, on_end);
+        for (const string_view& chunk : req.body_chunks()) {
+            if (!parser.feed(chunk)) {
+                return false;
+            }
+        }
+        return parser.done();
+    }
+}
+
+#endif /* MULTIPART_HPP */
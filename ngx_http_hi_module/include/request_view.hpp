@@ -0,0 +1,241 @@
+#ifndef REQUEST_VIEW_HPP
+#define REQUEST_VIEW_HPP
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include "string_view.hpp"
+#include "request.hpp"
+
+namespace hi {
+
+    struct field {
+        string_view key, value;
+    };
+
+    class field_list {
+    public:
+
+        field_list() : first(0), last(0) {
+        }
+
+        field_list(const field* data, size_t size) : first(data), last(data + size) {
+        }
+
+        const field* begin()const {
+            return this->first;
+        }
+
+        const field* end()const {
+            return this->last;
+        }
+
+        size_t size()const {
+            return this->last - this->first;
+        }
+
+        bool empty()const {
+            return this->first == this->last;
+        }
+
+        /*
+         * A key given more than once yields its last value, as it would in
+         * the maps of hi::request.
+         */
+        bool find(const string_view& key, string_view& value)const {
+            for (const field* p = this->last; p != this->first;) {
+                --p;
+                if (p->key == key) {
+                    value = p->value;
+                    return true;
+                }
+            }
+            return false;
+        }
+
+    private:
+        const field* first, *last;
+    };
+
+    /*
+     * The pieces a request body arrived in, in order.
+     */
+    class chunk_list {
+    public:
+
+        chunk_list() : first(0), last(0) {
+        }
+
+        chunk_list(const string_view* data, size_t size) : first(data), last(data + size) {
+        }
+
+        const string_view* begin()const {
+            return this->first;
+        }
+
+        const string_view* end()const {
+            return this->last;
+        }
+
+        size_t size()const {
+            return this->last - this->first;
+        }
+
+        bool empty()const {
+            return this->first == this->last;
+        }
+
+    private:
+        const string_view* first, *last;
+    };
+
+    /*
+     * Read-only access to a request without copying it. Everything returned
+     * stays valid until the request is finalized, headers, form and cookies
+     * are only split up the first time they are asked for.
+     */
+    class request_view {
+    public:
+        request_view() = default;
+        virtual~request_view() = default;
+
+        virtual string_view client() = 0;
+        virtual string_view user_agent() = 0;
+        virtual string_view method() = 0;
+        virtual string_view uri() = 0;
+        virtual string_view param() = 0;
+        virtual field_list headers() = 0;
+        virtual field_list form() = 0;
+        virtual field_list cookies() = 0;
+        virtual field_list session() = 0;
+
+        virtual string_view content_type() {
+            return this->get_header("Content-Type");
+        }
+
+        /*
+         * The whole request body in one piece, a body that was written to
+         * a temporary file is mapped instead of read.
+         */
+        virtual string_view body() {
+            return string_view();
+        }
+
+        /*
+         * The request body as it is held, for reading it piece by piece
+         * without joining it.
+         */
+        virtual chunk_list body_chunks() {
+            return chunk_list();
+        }
+
+        bool has_header(const string_view& key) {
+            string_view value;
+            return this->headers().find(key, value);
+        }
+
+        string_view get_header(const string_view& key) {
+            string_view value;
+            this->headers().find(key, value);
+            return value;
+        }
+
+        bool has_form(const string_view& key) {
+            string_view value;
+            return this->form().find(key, value);
+        }
+
+        string_view get_form(const string_view& key) {
+            string_view value;
+            this->form().find(key, value);
+            return value;
+        }
+
+        bool has_cookie(const string_view& key) {
+            string_view value;
+            return this->cookies().find(key, value);
+        }
+
+        string_view get_cookie(const string_view& key) {
+            string_view value;
+            this->cookies().find(key, value);
+            return value;
+        }
+
+        bool has_session(const string_view& key) {
+            string_view value;
+            return this->session().find(key, value);
+        }
+
+        string_view get_session(const string_view& key) {
+            string_view value;
+            this->session().find(key, value);
+            return value;
+        }
+    };
+
+    /*
+     * A request_view over an already filled hi::request.
+     */
+    class request_map_view : public request_view {
+    public:
+
+        request_map_view(request& req) : req(req), h(), f(), c(), s() {
+            fill(req.headers, this->h);
+            fill(req.form, this->f);
+            fill(req.cookies, this->c);
+            fill(req.session, this->s);
+        }
+
+        string_view client() {
+            return this->req.client;
+        }
+
+        string_view user_agent() {
+            return this->req.user_agent;
+        }
+
+        string_view method() {
+            return this->req.method;
+        }
+
+        string_view uri() {
+            return this->req.uri;
+        }
+
+        string_view param() {
+            return this->req.param;
+        }
+
+        field_list headers() {
+            return field_list(this->h.data(), this->h.size());
+        }
+
+        field_list form() {
+            return field_list(this->f.data(), this->f.size());
+        }
+
+        field_list cookies() {
+            return field_list(this->c.data(), this->c.size());
+        }
+
+        field_list session() {
+            return field_list(this->s.data(), this->s.size());
+        }
+
+    private:
+
+        static void fill(const std::unordered_map<std::string, std::string>& m, std::vector<field>& v) {
+            v.reserve(m.size());
+            for (const auto& item : m) {
+                field f = {item.first, item.second};
+                v.push_back(f);
+            }
+        }
+
+        request& req;
+        std::vector<field> h, f, c, s;
+    };
+}
+
+#endif /* REQUEST_VIEW_HPP */
@@ -2,28 +2,164 @@
 #define RESPONSE_HPP
 
 #include <string>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <vector>
 #include <unordered_map>
+#include <unordered_set>
 
 namespace hi {
 
     class response {
     public:
 
+        /*
+         * Hands out memory that lives until the request is finalized.
+         */
+        class allocator {
+        public:
+            allocator() = default;
+            virtual~allocator() = default;
+            virtual char* allocate(size_t n) = 0;
+        };
+
+        struct part {
+            const char* data;
+            size_t size;
+        };
+
+        /*
+         * Passed to a producer, write copies into send buffers that are
+         * reused once the client has taken them, flush asks for what was
+         * written so far to be sent right away.
+         */
+        class writer {
+        public:
+            writer() = default;
+            virtual~writer() = default;
+            virtual void write(const char* data, size_t n) = 0;
+            virtual void flush() = 0;
+
+            void write(const std::string& data) {
+                this->write(data.data(), data.size());
+            }
+        };
+
+        /*
+         * Called again whenever the client can take more, returns false
+         * once the body is complete.
+         */
+        typedef std::function<bool(writer&) > producer_t;
+
         response() :
         status(404)
         , content("<p style='text-align:center;margin:100px;'>404 Not Found</p>")
         , headers()
-        , session() {
+        , session()
+        , session_deleted()
+        , parts()
+        , pool(0)
+        , producer()
+        , stream_length(-1)
+        , owned()
+        , held() {
             this->headers.insert(std::make_pair("Content-Type", "text/html;charset=UTF-8"));
         }
         virtual~response() = default;
 
+        // parts may point into the owned buffers
+        response(const response&) = delete;
+        response& operator=(const response&) = delete;
+
+        /*
+         * Adds n bytes to the body after content and returns them to be
+         * filled in, they are sent from where they are without a copy.
+         */
+        char* reserve(size_t n) {
+            char* p;
+            if (this->pool) {
+                p = this->pool->allocate(n);
+            } else {
+                this->owned.push_back(std::string(n, '\0'));
+                p = &this->owned.back()[0];
+            }
+            if (p && n > 0) {
+                part item = {p, n};
+                this->parts.push_back(item);
+            }
+            return p;
+        }
+
+        /*
+         * Adds data to the body after content, the response keeps it until
+         * it has been sent.
+         */
+        void append(std::string&& data) {
+            if (data.empty()) {
+                return;
+            }
+            this->owned.push_back(std::move(data));
+            part item = {this->owned.back().data(), this->owned.back().size()};
+            this->parts.push_back(item);
+        }
+
+        /*
+         * Adds n bytes at data to the body after content without a copy,
+         * owner is kept until the response is gone.
+         */
+        void attach(const char* data, size_t n, const std::shared_ptr<const void>& owner) {
+            if (n == 0) {
+                return;
+            }
+            this->held.push_back(owner);
+            part item = {data, n};
+            this->parts.push_back(item);
+        }
+
+        /*
+         * Sends the body from producer after content, with length the
+         * number of bytes it will write or -1 for chunked encoding.
+         */
+        void stream(const producer_t& fn, long long length = -1) {
+            this->producer = fn;
+            this->stream_length = length;
+        }
+
+        size_t body_size()const {
+            size_t n = this->content.size();
+            for (const auto& item : this->parts) {
+                n += item.size;
+            }
+            return n;
+        }
+
+        std::string body()const {
+            if (this->parts.empty()) {
+                return this->content;
+            }
+            std::string result;
+            result.reserve(this->body_size());
+            result.append(this->content);
+            for (const auto& item : this->parts) {
+                result.append(item.data, item.size);
+            }
+            return result;
+        }
+
         int status;
         std::string content;
         std::unordered_multimap<std::string, std::string> headers;
         std::unordered_map<std::string, std::string> session;
+        std::unordered_set<std::string> session_deleted;
+        std::vector<part> parts;
+        allocator* pool;
+        producer_t producer;
+        long long stream_length;
+    private:
+        std::deque<std::string> owned;
+        std::vector<std::shared_ptr<const void>> held;
     };
 }
 
 #endif /* RESPONSE_HPP */
-
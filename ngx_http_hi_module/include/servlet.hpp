@@ -1,11 +1,31 @@
 #ifndef SERVLET_HPP
 #define SERVLET_HPP
 
+#include <string>
 #include "request.hpp"
 #include "response.hpp"
+#include "request_view.hpp"
+
+/*
+ * Raised whenever request, response or servlet change in a way that breaks
+ * servlets built against the older headers. Every servlet module exports it
+ * through hi_abi_version(), and one that does not match is not loaded.
+ */
+#define HI_ABI_VERSION 1
 
 namespace hi {
 
+    /*
+     * Passed to the optional hi_init() a servlet module may export, which
+     * runs once in every worker before the first request, hi_fini() runs
+     * when the worker exits.
+     */
+    struct worker_ctx {
+        int worker;
+        int pid;
+        std::string module;
+    };
+
     class servlet {
     public:
         servlet() = default;
@@ -14,8 +34,35 @@ namespace hi {
         virtual void handler(request& req, response& res) = 0;
         typedef servlet * create_t();
         typedef void destroy_t(servlet *);
+        typedef bool init_t(const worker_ctx&);
+        typedef void fini_t();
+        typedef bool view_t();
+        typedef int abi_t();
+        static const int abi_version = HI_ABI_VERSION;
+    };
+
+    /*
+     * A servlet that reads the request through a request_view. The module
+     * exporting it also exports hi_view_servlet() returning true, then the
+     * request is not copied into a hi::request before handler runs.
+     */
+    class view_servlet : public servlet {
+    public:
+        view_servlet() = default;
+        virtual~view_servlet() = default;
+
+        virtual void handler(request_view& req, response& res) = 0;
+
+        void handler(request& req, response& res) {
+            request_map_view view(req);
+            this->handler(view, res);
+        }
     };
 }
 
+extern "C" __attribute__((used, visibility("default"))) inline int hi_abi_version() {
+    return HI_ABI_VERSION;
+}
+
 #endif /* SERVLET_HPP */
 
@@ -0,0 +1,112 @@
+#ifndef STRING_VIEW_HPP
+#define STRING_VIEW_HPP
+
+#include <cstddef>
+#include <cstring>
+#include <string>
+#include <ostream>
+
+namespace hi {
+
+    /*
+     * A non-owning reference to a run of chars, the subset of
+     * std::string_view the module needs while it is built as c++11.
+     */
+    class string_view {
+    public:
+        static const size_t npos = static_cast<size_t> (-1);
+
+        string_view() : ptr(0), len(0) {
+        }
+
+        string_view(const char* s) : ptr(s), len(s ? strlen(s) : 0) {
+        }
+
+        string_view(const char* s, size_t n) : ptr(s), len(n) {
+        }
+
+        string_view(const std::string& s) : ptr(s.data()), len(s.size()) {
+        }
+
+        const char* data()const {
+            return this->ptr;
+        }
+
+        size_t size()const {
+            return this->len;
+        }
+
+        size_t length()const {
+            return this->len;
+        }
+
+        bool empty()const {
+            return this->len == 0;
+        }
+
+        const char* begin()const {
+            return this->ptr;
+        }
+
+        const char* end()const {
+            return this->ptr + this->len;
+        }
+
+        char operator[](size_t i)const {
+            return this->ptr[i];
+        }
+
+        std::string to_string()const {
+            return std::string(this->ptr, this->len);
+        }
+
+        explicit operator std::string()const {
+            return this->to_string();
+        }
+
+        int compare(const string_view& other)const {
+            int rc = memcmp(this->ptr, other.ptr, this->len < other.len ? this->len : other.len);
+            if (rc != 0) {
+                return rc;
+            }
+            return this->len < other.len ? -1 : (this->len > other.len ? 1 : 0);
+        }
+
+        size_t find(char c, size_t pos = 0)const {
+            if (pos >= this->len) {
+                return npos;
+            }
+            const void* p = memchr(this->ptr + pos, c, this->len - pos);
+            return p ? (const char*) p - this->ptr : npos;
+        }
+
+        string_view substr(size_t pos, size_t n = npos)const {
+            if (pos > this->len) {
+                pos = this->len;
+            }
+            return string_view(this->ptr + pos, n < this->len - pos ? n : this->len - pos);
+        }
+
+    private:
+        const char* ptr;
+        size_t len;
+    };
+
+    inline bool operator==(const string_view& a, const string_view& b) {
+        return a.size() == b.size() && memcmp(a.data(), b.data(), a.size()) == 0;
+    }
+
+    inline bool operator!=(const string_view& a, const string_view& b) {
+        return !(a == b);
+    }
+
+    inline bool operator<(const string_view& a, const string_view& b) {
+        return a.compare(b) < 0;
+    }
+
+    inline std::ostream& operator<<(std::ostream& os, const string_view& s) {
+        return os.write(s.data(), s.size());
+    }
+}
+
+#endif /* STRING_VIEW_HPP */
@@ -2,7 +2,15 @@
 #define BOOST_PY_HPP
 
 #include <unistd.h>
+#include <sys/stat.h>
+#include <ctime>
+#include <chrono>
+#include <memory>
 #include <string>
+#include <stdexcept>
+#include <fstream>
+#include <sstream>
+#include <unordered_map>
 #include <boost/python.hpp>
 
 
@@ -13,18 +21,107 @@
 
 namespace hi {
 
+    /*
+     * One namespace of the interpreter, every location running python has
+     * its own, or several when its requests run on a thread pool. The
+     * hi_request and hi_response classes are set up by the first one. It
+     * must be created, used and destroyed with the GIL held.
+     */
     class boost_py {
     public:
 
+        // microseconds spent waiting for the GIL and holding it
+        struct gil_time {
+            long long wait = 0, held = 0;
+        };
+
+        /*
+         * Holds the GIL for as long as it lives, from any thread. The first
+         * one starts the interpreter and lets go of the GIL it starts with,
+         * so it is only taken by these from then on.
+         */
+        class gil {
+        public:
+
+            explicit gil(gil_time* time = 0) : time(time), start(clock::now()), state(), taken() {
+                if (!Py_IsInitialized()) {
+                    Py_Initialize();
+#if PY_VERSION_HEX < 0x03070000
+                    PyEval_InitThreads();
+#endif
+                    PyEval_SaveThread();
+                }
+                this->state = PyGILState_Ensure();
+                this->taken = clock::now();
+            }
+
+            virtual~gil() {
+                PyGILState_Release(this->state);
+                if (this->time) {
+                    this->time->wait += std::chrono::duration_cast<std::chrono::microseconds>(this->taken - this->start).count();
+                    this->time->held += std::chrono::duration_cast<std::chrono::microseconds>(clock::now() - this->taken).count();
+                }
+            }
+
+            gil(const gil&) = delete;
+            gil& operator=(const gil&) = delete;
+
+        private:
+            typedef std::chrono::steady_clock clock;
+            gil_time* time;
+            clock::time_point start;
+            PyGILState_STATE state;
+            clock::time_point taken;
+        };
+
+        /*
+         * hi_req of a namespace. Its mappings are built the first time a
+         * request asks for them and dropped when the next request starts.
+         */
+        struct py_request_t : public py_request {
+
+            void init(request* req, request_view* view) {
+                py_request::init(req, view);
+                this->form = this->headers = this->cookies = this->session = this->body = boost::python::object();
+            }
+
+            boost::python::object form, headers, cookies, session, body;
+        };
+
         boost_py() :
         main()
         , dict()
-        , res(0)
-        , error_message("<p style='text-align:center;margin:100px;'>Server script error</p>") {
-            Py_Initialize();
+        , req()
+        , res()
+        , req_obj()
+        , res_obj()
+        , error_message("<p style='text-align:center;margin:100px;'>Server script error</p>")
+        , scripts()
+        , contents() {
             this->main = boost::python::import("__main__");
-            this->dict = this->main.attr("__dict__");
-            this->dict["hi_request"] = boost::python::class_<hi::py_request>("hi_request")
+            boost::python::object main_dict = this->main.attr("__dict__");
+            if (PyDict_GetItemString(main_dict.ptr(), "hi_request") == NULL) {
+                register_classes(main_dict);
+            }
+            this->dict = boost::python::dict();
+            this->dict["__name__"] = "__main__";
+            this->dict["__builtins__"] = main_dict["__builtins__"];
+            this->dict["hi_request"] = main_dict["hi_request"];
+            this->dict["hi_response"] = main_dict["hi_response"];
+            this->req_obj = boost::python::object(boost::python::ptr(&this->req));
+            this->res_obj = boost::python::object(boost::python::ptr(&this->res));
+            this->dict["hi_req"] = this->req_obj;
+            this->dict["hi_res"] = this->res_obj;
+        }
+
+        // the interpreter is left to the end of the process
+        virtual~boost_py() {
+            this->scripts.clear();
+            this->contents.clear();
+        }
+
+        static void register_classes(boost::python::object& dict) {
+            dict["hi_request"] = boost::python::class_<py_request_t>("hi_request")
                     .def("uri", &hi::py_request::uri)
                     .def("method", &hi::py_request::method)
                     .def("client", &hi::py_request::client)
@@ -37,57 +134,258 @@ namespace hi {
                     .def("get_header", &hi::py_request::get_header)
                     .def("get_cookie", &hi::py_request::get_cookie)
                     .def("get_form", &hi::py_request::get_form)
-                    .def("get_session", &hi::py_request::get_session);
-            this->dict["hi_response"] = boost::python::class_<hi::py_response>("hi_response")
+                    .def("get_session", &hi::py_request::get_session)
+                    .add_property("form", &boost_py::form)
+                    .add_property("headers", &boost_py::headers)
+                    .add_property("cookies", &boost_py::cookies)
+                    .add_property("session", &boost_py::session)
+                    .add_property("body", &boost_py::body);
+            dict["hi_response"] = boost::python::class_<hi::py_response>("hi_response")
                     .def("status", &hi::py_response::status)
-                    .def("content", &hi::py_response::content)
+                    .def("content", &boost_py::content)
                     .def("header", &hi::py_response::header)
-                    .def("session", &hi::py_response::session);
-        }
-
-        virtual~boost_py() {
-            Py_Finalize();
-            this->res = 0;
+                    .def("session", &hi::py_response::session)
+                    .def("del_session", &hi::py_response::del_session)
+                    .def("stream", &boost_py::stream)
+                    .def("stream", &boost_py::stream_length);
         }
 
-        void set_req(py_request* req) {
-            this->dict["hi_req"] = boost::python::ptr(req);
+        // hi_req and hi_res stay bound, only what they point to changes
+        void set(request& req, response& res, request_view* view = 0) {
+            this->req.init(&req, view);
+            this->res.init(&res);
         }
 
-        void set_res(py_response* res) {
-            this->res = res;
-            this->dict["hi_res"] = boost::python::ptr(res);
-        }
-
-        void call_script(const std::string& py_script) {
-            if (access(py_script.c_str(), F_OK) == 0) {
-                try {
-                    boost::python::exec_file(py_script.c_str(), this->dict, this->dict);
-                } catch (const boost::python::error_already_set&) {
-                    this->clear_error();
-                    this->res->status(500);
-                    this->res->content(this->error_message);
+        /*
+         * The compiled script is kept until its inode, size or mtime
+         * changes, which is looked at again once valid seconds have passed.
+         * A script that defines handle(req, res) runs once when it is
+         * loaded, after that only handle is called.
+         */
+        void call_script(const std::string& py_script, time_t valid = 0) {
+            try {
+                time_t now = time(NULL);
+                script_t& script = this->scripts[py_script];
+                if (script.code.is_none() || now - script.checked >= valid) {
+                    struct stat st;
+                    if (stat(py_script.c_str(), &st) != 0) {
+                        this->scripts.erase(py_script);
+                        return;
+                    }
+                    script.checked = now;
+                    if (script.code.is_none() || st.st_ino != script.ino || st.st_size != script.size || st.st_mtime != script.mtime) {
+                        script.code = boost::python::object();
+                        script.handle = boost::python::object();
+                        boost::python::object code = this->compile(this->read(py_script), py_script);
+                        if (PyDict_GetItemString(this->dict.ptr(), "handle")) {
+                            PyDict_DelItemString(this->dict.ptr(), "handle");
+                        }
+                        // kept only once it ran, a failed first run is retried
+                        this->eval(code);
+                        script.code = code;
+                        script.ino = st.st_ino;
+                        script.size = st.st_size;
+                        script.mtime = st.st_mtime;
+                        PyObject* handle = PyDict_GetItemString(this->dict.ptr(), "handle");
+                        if (handle == NULL || !PyCallable_Check(handle)) {
+                            return;
+                        }
+                        script.handle = boost::python::object(boost::python::borrowed(handle));
+                    }
+                }
+                if (script.handle.is_none()) {
+                    this->eval(script.code);
+                } else {
+                    script.handle(this->req_obj, this->res_obj);
                 }
+            } catch (const boost::python::error_already_set&) {
+                this->clear_error();
+                this->res.status(500);
+                this->res.content(this->error_message);
             }
         }
 
         void call_content(const std::string& py_content) {
             try {
-                boost::python::exec(py_content.c_str(), this->dict, this->dict);
+                this->eval(this->load_content(py_content));
             } catch (const boost::python::error_already_set&) {
                 this->clear_error();
-                this->res->status(500);
-                this->res->content(this->error_message);
+                this->res.status(500);
+                this->res.content(this->error_message);
             }
         }
 
         void clear_error() {
             PyErr_Clear();
         }
+
+        // compiles py_content ahead of the first call_content
+        const boost::python::object& load_content(const std::string& py_content) {
+            auto item = this->contents.find(py_content);
+            if (item == this->contents.end()) {
+                item = this->contents.insert(std::make_pair(py_content, this->compile(py_content, "<string>"))).first;
+            }
+            return item->second;
+        }
+
+        static boost::python::object form(py_request_t& req) {
+            return mapping(req.form, req.fields().form);
+        }
+
+        static boost::python::object headers(py_request_t& req) {
+            return mapping(req.headers, req.fields().headers);
+        }
+
+        static boost::python::object cookies(py_request_t& req) {
+            return mapping(req.cookies, req.fields().cookies);
+        }
+
+        static boost::python::object session(py_request_t& req) {
+            return mapping(req.session, req.fields().session);
+        }
+
+        /*
+         * hi_req.body is a read-only memoryview of the body where nginx
+         * holds it, it must not be kept past the request.
+         */
+        static boost::python::object body(py_request_t& req) {
+            if (req.body.is_none()) {
+                string_view data = req.py_request::body();
+                char* p = (char*) (data.empty() ? "" : data.data());
+#if PY_MAJOR_VERSION >= 3
+                req.body = boost::python::object(boost::python::handle<>(PyMemoryView_FromMemory(p, data.size(), PyBUF_READ)));
+#else
+                req.body = boost::python::object(boost::python::handle<>(PyBuffer_FromMemory(p, data.size())));
+#endif
+            }
+            return req.body;
+        }
+
+        /*
+         * hi_res.content(data) takes str, or bytes that are sent from where
+         * they are without a copy.
+         */
+        static void content(py_response& res, boost::python::object data) {
+            PyObject* p = data.ptr();
+#if PY_MAJOR_VERSION >= 3
+            if (PyBytes_Check(p)) {
+                Py_INCREF(p);
+                res.content(PyBytes_AS_STRING(p), PyBytes_GET_SIZE(p), std::shared_ptr<const void>(p, [](const void* p) {
+                    gil lock;
+                    Py_DECREF((PyObject*) p);
+                }));
+                return;
+            }
+#endif
+            res.content(boost::python::extract<std::string>(data)());
+        }
+
+        /*
+         * hi_res.stream(iterable[, length]) sends every str the iterable
+         * yields as soon as the client can take it.
+         */
+        static void stream(py_response& res, boost::python::object iterable) {
+            stream_length(res, iterable, -1);
+        }
+
+        /*
+         * The producer runs on the event loop, so it takes the GIL itself,
+         * and so does the last owner of the iterator. An exception in the
+         * iterator or an item that is not a str aborts the response.
+         */
+        static void stream_length(py_response& res, boost::python::object iterable, long long length) {
+            std::shared_ptr<boost::python::object> it(new boost::python::object(boost::python::handle<>(PyObject_GetIter(iterable.ptr())))
+                    , [](boost::python::object * p) {
+                        gil lock;
+                        delete p;
+                    });
+            res.stream([it](response::writer & w) {
+                gil lock;
+                PyObject* item = PyIter_Next(it->ptr());
+                if (item == NULL) {
+                    if (PyErr_Occurred()) {
+                        throw std::runtime_error(error_text());
+                    }
+                    return false;
+                }
+                boost::python::object data = boost::python::object(boost::python::handle<>(item));
+                boost::python::extract<std::string> str(data);
+                if (!str.check()) {
+                    throw std::runtime_error("hi_res.stream item is not a str");
+                }
+                w.write(str());
+                return true;
+            }, length);
+        }
     private:
+
+        // the pending python error as text, which clears it
+        static std::string error_text() {
+            PyObject *type, *value, *trace;
+            std::string text("python error");
+            PyErr_Fetch(&type, &value, &trace);
+            PyObject* str = value ? PyObject_Str(value) : NULL;
+            if (str) {
+                boost::python::extract<std::string> s(str);
+                if (s.check()) {
+                    text = s();
+                }
+                Py_DECREF(str);
+            }
+            Py_XDECREF(type);
+            Py_XDECREF(value);
+            Py_XDECREF(trace);
+            PyErr_Clear();
+            return text;
+        }
+
+        struct script_t {
+            boost::python::object code, handle;
+            ino_t ino = 0;
+            off_t size = 0;
+            time_t mtime = 0, checked = 0;
+        };
+
+        // a read-only dict of m, made once per request
+        static boost::python::object mapping(boost::python::object& cache, const std::unordered_map<std::string, std::string>& m) {
+            if (cache.is_none()) {
+                boost::python::dict d;
+                for (const auto& item : m) {
+                    d[item.first] = item.second;
+                }
+                cache = boost::python::object(boost::python::handle<>(PyDictProxy_New(d.ptr())));
+            }
+            return cache;
+        }
+
+        static std::string read(const std::string& path) {
+            std::ifstream file(path);
+            std::stringstream buffer;
+            buffer << file.rdbuf();
+            return buffer.str();
+        }
+
+        // throws error_already_set on a syntax error
+        static boost::python::object compile(const std::string& source, const std::string& name) {
+            return boost::python::object(boost::python::handle<>(Py_CompileString(source.c_str(), name.c_str(), Py_file_input)));
+        }
+
+        void eval(const boost::python::object& code) {
+#if PY_MAJOR_VERSION >= 3
+            PyObject* result = PyEval_EvalCode(code.ptr(), this->dict.ptr(), this->dict.ptr());
+#else
+            PyObject* result = PyEval_EvalCode((PyCodeObject*) code.ptr(), this->dict.ptr(), this->dict.ptr());
+#endif
+            boost::python::handle<> done(result);
+        }
+
         boost::python::object main, dict;
-        py_response* res;
+        py_request_t req;
+        py_response res;
+        boost::python::object req_obj, res_obj;
         std::string error_message;
+        std::unordered_map<std::string, script_t> scripts;
+        std::unordered_map<std::string, boost::python::object> contents;
     };
 }
 
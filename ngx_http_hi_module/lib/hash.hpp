@@ -0,0 +1,104 @@
+#ifndef HASH_HPP
+#define HASH_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+namespace cache {
+
+    struct key128 {
+        uint64_t lo = 0, hi = 0;
+
+        bool operator==(const key128& other) const {
+            return this->lo == other.lo && this->hi == other.hi;
+        }
+    };
+
+    struct key128_hash {
+
+        size_t operator()(const key128& key) const {
+            return (size_t) key.lo;
+        }
+    };
+
+    static inline uint64_t rotl64(uint64_t x, int r) {
+        return (x << r) | (x >> (64 - r));
+    }
+
+    static inline uint64_t fmix64(uint64_t k) {
+        k ^= k >> 33;
+        k *= 0xff51afd7ed558ccdULL;
+        k ^= k >> 33;
+        k *= 0xc4ceb9fe1a85ec53ULL;
+        k ^= k >> 33;
+        return k;
+    }
+
+    /*
+     * MurmurHash3 x64/128 with the two lanes seeded by a previous result, so
+     * that a key spread over several buffers can be hashed without joining
+     * them first.
+     */
+    static inline key128 hash128(const void* data, size_t len, const key128& seed = key128()) {
+        const uint64_t c1 = 0x87c37b91114253d5ULL, c2 = 0x4cf5ad432745937fULL;
+        const unsigned char* p = (const unsigned char*) data;
+        uint64_t h1 = seed.lo, h2 = seed.hi, k1, k2;
+        size_t nblocks = len / 16;
+
+        for (size_t i = 0; i < nblocks; ++i, p += 16) {
+            memcpy(&k1, p, 8);
+            memcpy(&k2, p + 8, 8);
+
+            k1 *= c1;
+            k1 = rotl64(k1, 31);
+            k1 *= c2;
+            h1 ^= k1;
+            h1 = rotl64(h1, 27);
+            h1 += h2;
+            h1 = h1 * 5 + 0x52dce729;
+
+            k2 *= c2;
+            k2 = rotl64(k2, 33);
+            k2 *= c1;
+            h2 ^= k2;
+            h2 = rotl64(h2, 31);
+            h2 += h1;
+            h2 = h2 * 5 + 0x38495ab5;
+        }
+
+        size_t rest = len & 15;
+        if (rest) {
+            unsigned char tail[16] = {0};
+            memcpy(tail, p, rest);
+            memcpy(&k1, tail, 8);
+            memcpy(&k2, tail + 8, 8);
+            if (rest > 8) {
+                k2 *= c2;
+                k2 = rotl64(k2, 33);
+                k2 *= c1;
+                h2 ^= k2;
+            }
+            k1 *= c1;
+            k1 = rotl64(k1, 31);
+            k1 *= c2;
+            h1 ^= k1;
+        }
+
+        h1 ^= len;
+        h2 ^= len;
+        h1 += h2;
+        h2 += h1;
+        h1 = fmix64(h1);
+        h2 = fmix64(h2);
+        h1 += h2;
+        h2 += h1;
+
+        key128 result;
+        result.lo = h1;
+        result.hi = h2;
+        return result;
+    }
+}
+
+#endif /* HASH_HPP */
@@ -1,73 +1,518 @@
 #ifndef _LRUCACHE_HPP_INCLUDED_
 #define _LRUCACHE_HPP_INCLUDED_
 
-#include <unordered_map>
-#include <list>
 #include <cstddef>
+#include <cstdint>
+#include <functional>
 #include <stdexcept>
+#include <utility>
+#include <vector>
 
 namespace cache {
 
+    enum policy_t {
+        lru, tinylfu
+    };
+
+    /*
+     * Count-min sketch of 4-bit counters, four to a key, packed sixteen to a
+     * word. Every counter is halved once ten times as many keys as it has
+     * words were added, so old popularity fades.
+     */
+    class frequency_sketch {
+    public:
+
+        frequency_sketch() : _table(), _mask(0), _additions(0), _sample(0) {
+        }
+
+        /*
+         * Sized for about capacity keys. Growing keeps what was counted,
+         * halved: a key's word in the larger table is one whose index has
+         * the old one in its low bits, so every old word is copied there.
+         */
+        void ensure(size_t capacity) {
+            size_t n = 64, old = this->_table.size();
+            while (n < capacity) {
+                n <<= 1;
+            }
+            if (n <= old) {
+                return;
+            }
+            std::vector<uint64_t> table(n, 0);
+            for (size_t i = 0; old > 0 && i < n; ++i) {
+                table[i] = (this->_table[i & (old - 1)] >> 1) & 0x7777777777777777ULL;
+            }
+            this->_table.swap(table);
+            this->_mask = n - 1;
+            this->_additions /= 2;
+            this->_sample = 10 * n;
+        }
+
+        size_t capacity() const {
+            return this->_table.size();
+        }
+
+        unsigned frequency(size_t hash) const {
+            unsigned f = 15;
+            for (unsigned i = 0; i < 4; ++i) {
+                size_t index, offset;
+                this->locate(hash, i, index, offset);
+                unsigned c = (unsigned) (this->_table[index] >> offset) & 15;
+                if (c < f) {
+                    f = c;
+                }
+            }
+            return f;
+        }
+
+        void increment(size_t hash) {
+            bool added = false;
+            for (unsigned i = 0; i < 4; ++i) {
+                size_t index, offset;
+                this->locate(hash, i, index, offset);
+                if (((this->_table[index] >> offset) & 15) != 15) {
+                    this->_table[index] += (uint64_t) 1 << offset;
+                    added = true;
+                }
+            }
+            if (added && ++this->_additions >= this->_sample) {
+                this->reset();
+            }
+        }
+
+    private:
+
+        void locate(size_t hash, unsigned i, size_t& index, size_t& offset) const {
+            static const uint64_t seed[] = {0xc3a5c85c97cb3127ULL, 0xb492b66fbe98f273ULL, 0x9ae16a3b2f90404fULL, 0xcbf29ce484222325ULL};
+            uint64_t h = ((uint64_t) hash + seed[i]) * 0x9e3779b97f4a7c15ULL;
+            h ^= h >> 32;
+            index = (size_t) (h >> 4) & this->_mask;
+            offset = (size_t) (h & 15) << 2;
+        }
+
+        void reset() {
+            for (uint64_t& word : this->_table) {
+                word = (word >> 1) & 0x7777777777777777ULL;
+            }
+            this->_additions /= 2;
+        }
+
+        std::vector<uint64_t> _table;
+        size_t _mask, _additions, _sample;
+    };
+
     template<typename key_t, typename value_t>
+    struct no_weigher {
+
+        size_t operator()(const key_t&, const value_t&) const {
+            return 0;
+        }
+    };
+
+    /*
+     * Entries live in a node array that is only grown up to max_size and then
+     * recycled, the LRU list is threaded through the nodes by index and the
+     * open-addressed slot table maps a key to its node.  In steady state put
+     * and erase do not allocate.
+     *
+     * max_size bounds the number of entries and max_bytes the sum of the
+     * weigher_t weights, zero disables either limit.
+     *
+     * With the tinylfu policy new entries go to a window LRU of 1% of the
+     * capacity, by bytes when max_bytes is set. An entry pushed out of the
+     * window only stays when the frequency_sketch has seen its key more
+     * often than that of the entry it would evict from the main part, a
+     * segmented LRU whose protected segment holds the 80% hit more than
+     * once. A scan of one-off keys thus no longer flushes the hot ones.
+     */
+    template<typename key_t, typename value_t, typename hash_t = std::hash<key_t>, typename equal_t = std::equal_to<key_t>, typename weigher_t = no_weigher<key_t, value_t>>
     class lru_cache {
     public:
-        typedef typename std::pair<key_t, value_t> key_value_pair_t;
-        typedef typename std::list<key_value_pair_t>::iterator list_iterator_t;
 
-        lru_cache(size_t max_size) :
-        _max_size(max_size) {
+        lru_cache(size_t max_size, size_t max_bytes = 0, policy_t policy = lru) :
+        _policy(max_size > 0 || max_bytes > 0 ? policy : lru)
+        , _max_size(max_size)
+        , _max_bytes(max_bytes)
+        , _count(0)
+        , _bytes(0)
+        , _evictions(0)
+        , _window_limit(0)
+        , _protected_limit(0)
+        , _free(npos)
+        , _mask(0)
+        , _nodes()
+        , _slots()
+        , _sketch()
+        , _hasher()
+        , _equal()
+        , _weigher() {
+            for (int i = 0; i < SEGMENTS; ++i) {
+                this->_head[i] = this->_tail[i] = npos;
+                this->_used[i] = 0;
+            }
+            if (this->_policy == tinylfu) {
+                size_t limit = max_bytes > 0 ? max_bytes : max_size;
+                this->_window_limit = limit / 100 > 0 ? limit / 100 : 1;
+                this->_protected_limit = (limit - this->_window_limit) * 4 / 5;
+                this->_sketch.ensure(max_size);
+            }
+            this->rehash(16);
+        }
+
+        lru_cache(const lru_cache&) = delete;
+        lru_cache& operator=(const lru_cache&) = delete;
+
+        void put(key_t&& key, value_t&& value) {
+            size_t weight = this->_weigher(key, value);
+            size_t hash = this->_hasher(key), slot = this->lookup(key, hash);
+            uint32_t n;
+            if (this->_max_bytes > 0 && weight > this->_max_bytes) {
+                if (slot != npos) {
+                    this->erase_at(slot);
+                }
+                return;
+            }
+            if (slot != npos) {
+                n = this->_slots[slot];
+                this->touch(n, false);
+            } else {
+                n = this->insert(std::move(key), hash);
+            }
+            this->_nodes[n].value = std::move(value);
+            this->reweigh(n, weight);
+            this->shrink();
         }
 
-        void put(const key_t& key, const value_t& value) {
-            auto it = _cache_items_map.find(key);
-            _cache_items_list.push_front(key_value_pair_t(key, value));
-            if (it != _cache_items_map.end()) {
-                _cache_items_list.erase(it->second);
-                _cache_items_map.erase(it);
+        template <typename... Args>
+        value_t* emplace(key_t&& key, Args&&... args) {
+            size_t weight, hash = this->_hasher(key), slot = this->lookup(key, hash);
+            uint32_t n;
+            if (slot != npos) {
+                n = this->_slots[slot];
+                node_t& node = *this->touch(n, false);
+                node.value = value_t(std::forward<Args>(args)...);
+                this->reweigh(n, this->_weigher(node.key, node.value));
+            } else {
+                value_t value(std::forward<Args>(args)...);
+                weight = this->_weigher(key, value);
+                if (this->_max_bytes > 0 && weight > this->_max_bytes) {
+                    return NULL;
+                }
+                n = this->insert(std::move(key), hash);
+                this->_nodes[n].value = std::move(value);
+                this->reweigh(n, weight);
+            }
+            if (this->_max_bytes > 0 && this->_nodes[n].weight > this->_max_bytes) {
+                this->erase_at(this->lookup(this->_nodes[n].key, this->_nodes[n].hash));
+                return NULL;
             }
-            _cache_items_map[key] = _cache_items_list.begin();
+            this->shrink();
+            // a new entry may not have been admitted
+            if (this->_nodes[n].segment == FREE) {
+                return NULL;
+            }
+            return &this->_nodes[n].value;
+        }
 
-            if (_cache_items_map.size() > _max_size) {
-                auto last = _cache_items_list.end();
-                last--;
-                _cache_items_map.erase(last->first);
-                _cache_items_list.pop_back();
+        value_t* find(const key_t& key) {
+            size_t hash = this->_hasher(key), slot = this->lookup(key, hash);
+            if (slot == npos) {
+                if (this->_policy == tinylfu) {
+                    this->_sketch.increment(hash);
+                }
+                return NULL;
             }
+            return &this->touch(this->_slots[slot])->value;
         }
 
         const value_t& get(const key_t& key) {
-            auto it = _cache_items_map.find(key);
-            if (it == _cache_items_map.end()) {
+            value_t* v = this->find(key);
+            if (v == NULL) {
                 throw std::range_error("There is no such key in cache");
-            } else {
-                _cache_items_list.splice(_cache_items_list.begin(), _cache_items_list, it->second);
-                return it->second->second;
             }
+            return *v;
         }
 
         bool exists(const key_t& key) const {
-            return _cache_items_map.find(key) != _cache_items_map.end();
+            return this->lookup(key, this->_hasher(key)) != npos;
         }
 
         size_t size() const {
-            return _cache_items_map.size();
+            return this->_count;
+        }
+
+        size_t max_size() const {
+            return this->_max_size;
+        }
+
+        size_t bytes() const {
+            return this->_bytes;
+        }
+
+        size_t evictions() const {
+            return this->_evictions;
+        }
+
+        policy_t policy() const {
+            return this->_policy;
         }
 
         void erase(const key_t& key) {
-            auto it = _cache_items_map.find(key);
-            if (it != _cache_items_map.end()) {
-                _cache_items_list.erase(it->second);
-                _cache_items_map.erase(it);
+            size_t slot = this->lookup(key, this->_hasher(key));
+            if (slot != npos) {
+                this->erase_at(slot);
+            }
+        }
+
+        void clear() {
+            for (int i = 0; i < SEGMENTS; ++i) {
+                while (this->_head[i] != npos) {
+                    this->erase_at(this->lookup(this->_nodes[this->_head[i]].key, this->_nodes[this->_head[i]].hash));
+                }
             }
         }
 
     private:
-        std::list<key_value_pair_t> _cache_items_list;
-        std::unordered_map<key_t, list_iterator_t> _cache_items_map;
-        size_t _max_size;
+        static const uint32_t npos = UINT32_MAX;
+
+        // the lru policy only uses the window list
+        enum segment_t {
+            WINDOW, PROBATION, PROTECTED, SEGMENTS, FREE = SEGMENTS
+        };
+
+        struct node_t {
+            key_t key;
+            value_t value;
+            size_t hash, weight;
+            uint32_t prev, next;
+            uint8_t segment;
+        };
+
+        size_t lookup(const key_t& key, size_t hash) const {
+            size_t i = hash & this->_mask;
+            while (this->_slots[i] != npos) {
+                const node_t& node = this->_nodes[this->_slots[i]];
+                if (node.hash == hash && this->_equal(node.key, key)) {
+                    return i;
+                }
+                i = (i + 1) & this->_mask;
+            }
+            return npos;
+        }
+
+        // a put of a key that is there was counted by the find before it
+        node_t* touch(uint32_t n, bool access = true) {
+            node_t& node = this->_nodes[n];
+            if (this->_policy == tinylfu) {
+                if (access) {
+                    this->_sketch.increment(node.hash);
+                }
+                if (node.segment == PROBATION) {
+                    this->move(n, PROTECTED);
+                    while (this->_used[PROTECTED] > this->_protected_limit && this->_tail[PROTECTED] != n) {
+                        this->move(this->_tail[PROTECTED], PROBATION);
+                    }
+                    return &node;
+                }
+            }
+            this->move(n, node.segment);
+            return &node;
+        }
+
+        void move(uint32_t n, int segment) {
+            this->unlink(n);
+            this->link_front(n, segment);
+        }
+
+        size_t unit(const node_t& node) const {
+            return this->_max_bytes > 0 ? node.weight : 1;
+        }
+
+        void reweigh(uint32_t n, size_t weight) {
+            node_t& node = this->_nodes[n];
+            this->_used[node.segment] -= this->unit(node);
+            this->_bytes -= node.weight;
+            node.weight = weight;
+            this->_used[node.segment] += this->unit(node);
+            this->_bytes += node.weight;
+        }
+
+        bool full() const {
+            return (this->_max_size > 0 && this->_count > this->_max_size) || (this->_max_bytes > 0 && this->_bytes > this->_max_bytes);
+        }
+
+        void evict(uint32_t n) {
+            this->erase_at(this->lookup(this->_nodes[n].key, this->_nodes[n].hash));
+            ++this->_evictions;
+        }
+
+        /*
+         * Moves what no longer fits into the window to probation, each such
+         * candidate either takes the place of the main part's least recently
+         * used entry or is dropped itself.
+         */
+        void admit() {
+            while (this->_used[WINDOW] > this->_window_limit) {
+                uint32_t candidate = this->_tail[WINDOW];
+                this->move(candidate, PROBATION);
+                while (this->full() && this->_nodes[candidate].segment != FREE) {
+                    uint32_t victim = this->_tail[PROBATION] != candidate ? this->_tail[PROBATION] : this->_tail[PROTECTED];
+                    if (victim == npos || this->_sketch.frequency(this->_nodes[candidate].hash) <= this->_sketch.frequency(this->_nodes[victim].hash)) {
+                        victim = candidate;
+                    }
+                    this->evict(victim);
+                }
+            }
+            while (this->full()) {
+                int i = this->_tail[PROBATION] != npos ? PROBATION : this->_tail[PROTECTED] != npos ? PROTECTED : WINDOW;
+                this->evict(this->_tail[i]);
+            }
+        }
+
+        void erase_at(size_t slot) {
+            uint32_t n = this->_slots[slot];
+            this->erase_slot(slot);
+            this->unlink(n);
+            this->release(n);
+        }
+
+        void shrink() {
+            if (this->_policy == tinylfu) {
+                this->admit();
+                return;
+            }
+            while (this->_max_bytes > 0 && this->_bytes > this->_max_bytes && this->_tail[WINDOW] != this->_head[WINDOW]) {
+                this->evict(this->_tail[WINDOW]);
+            }
+        }
+
+        uint32_t insert(key_t&& key, size_t hash) {
+            uint32_t n;
+            // callers find the key first, which counted this access
+            if (this->_policy == tinylfu) {
+                if (this->_count >= this->_sketch.capacity()) {
+                    this->_sketch.ensure(this->_count * 2);
+                }
+            }
+            if (this->_policy == lru && this->_max_size > 0 && this->_count >= this->_max_size) {
+                n = this->_tail[WINDOW];
+                this->erase_slot(this->lookup(this->_nodes[n].key, this->_nodes[n].hash));
+                this->unlink(n);
+                this->_bytes -= this->_nodes[n].weight;
+                --this->_count;
+                ++this->_evictions;
+            } else if (this->_free != npos) {
+                n = this->_free;
+                this->_free = this->_nodes[n].next;
+            } else {
+                n = (uint32_t) this->_nodes.size();
+                this->_nodes.emplace_back();
+            }
+            if ((this->_count + 1) * 2 > this->_slots.size()) {
+                this->rehash(this->_slots.size() * 2);
+            }
+            node_t& node = this->_nodes[n];
+            node.key = std::move(key);
+            node.hash = hash;
+            node.weight = 0;
+            size_t i = node.hash & this->_mask;
+            while (this->_slots[i] != npos) {
+                i = (i + 1) & this->_mask;
+            }
+            this->_slots[i] = n;
+            this->link_front(n, WINDOW);
+            ++this->_count;
+            return n;
+        }
+
+        void erase_slot(size_t i) {
+            size_t j = i, k;
+            for (;;) {
+                j = (j + 1) & this->_mask;
+                if (this->_slots[j] == npos) {
+                    break;
+                }
+                k = this->_nodes[this->_slots[j]].hash & this->_mask;
+                if ((j > i && (k <= i || k > j)) || (j < i && k <= i && k > j)) {
+                    this->_slots[i] = this->_slots[j];
+                    i = j;
+                }
+            }
+            this->_slots[i] = npos;
+        }
+
+        void release(uint32_t n) {
+            node_t& node = this->_nodes[n];
+            node.key = key_t();
+            node.value = value_t();
+            node.segment = FREE;
+            node.next = this->_free;
+            this->_free = n;
+            this->_bytes -= node.weight;
+            --this->_count;
+        }
+
+        void rehash(size_t capacity) {
+            this->_slots.assign(capacity, npos);
+            this->_mask = capacity - 1;
+            for (int segment = 0; segment < SEGMENTS; ++segment) {
+                for (uint32_t n = this->_head[segment]; n != npos; n = this->_nodes[n].next) {
+                    size_t i = this->_nodes[n].hash & this->_mask;
+                    while (this->_slots[i] != npos) {
+                        i = (i + 1) & this->_mask;
+                    }
+                    this->_slots[i] = n;
+                }
+            }
+        }
+
+        void unlink(uint32_t n) {
+            node_t& node = this->_nodes[n];
+            if (node.prev != npos) {
+                this->_nodes[node.prev].next = node.next;
+            } else {
+                this->_head[node.segment] = node.next;
+            }
+            if (node.next != npos) {
+                this->_nodes[node.next].prev = node.prev;
+            } else {
+                this->_tail[node.segment] = node.prev;
+            }
+            this->_used[node.segment] -= this->unit(node);
+        }
+
+        void link_front(uint32_t n, int segment) {
+            node_t& node = this->_nodes[n];
+            node.segment = (uint8_t) segment;
+            node.prev = npos;
+            node.next = this->_head[segment];
+            if (this->_head[segment] != npos) {
+                this->_nodes[this->_head[segment]].prev = n;
+            }
+            this->_head[segment] = n;
+            if (this->_tail[segment] == npos) {
+                this->_tail[segment] = n;
+            }
+            this->_used[segment] += this->unit(node);
+        }
+
+        policy_t _policy;
+        size_t _max_size, _max_bytes, _count, _bytes, _evictions;
+        size_t _window_limit, _protected_limit;
+        uint32_t _head[SEGMENTS], _tail[SEGMENTS], _free;
+        size_t _used[SEGMENTS];
+        size_t _mask;
+        std::vector<node_t> _nodes;
+        std::vector<uint32_t> _slots;
+        frequency_sketch _sketch;
+        hash_t _hasher;
+        equal_t _equal;
+        weigher_t _weigher;
     };
 
+    template<typename key_t, typename value_t, typename hash_t, typename equal_t, typename weigher_t>
+    const uint32_t lru_cache<key_t, value_t, hash_t, equal_t, weigher_t>::npos;
+
 } // namespace lru
 
 #endif /* _LRUCACHE_HPP_INCLUDED_ */
-
@@ -2,9 +2,16 @@
 #define LUA_HPP
 
 #include <unistd.h>
+#include <sys/stat.h>
+#include <ctime>
+#include <string>
+#include <stdexcept>
+#include <vector>
+#include <unordered_map>
 #include "kaguya.hpp"
 #include "py_request.hpp"
 #include "py_response.hpp"
+#include "lua_ffi.hpp"
 
 namespace hi {
 
@@ -12,8 +19,12 @@ namespace hi {
     public:
 
         lua() : error_message("<p style='text-align:center;margin:100px;'>Server script error</p>")
-        , res(0)
-        , state() {
+        , state()
+        , scripts()
+        , contents()
+        , tasks()
+        , idle()
+        , io_(0) {
             this->state["hi_request"].setClass(
                     kaguya::UserdataMetatable<py_request>()
                     .setConstructors < py_request()>()
@@ -34,46 +45,344 @@ namespace hi {
             this->state["hi_response"].setClass(
                     kaguya::UserdataMetatable<py_response>()
                     .addFunction("status", &hi::py_response::status)
-                    .addFunction("content", &hi::py_response::content)
+                    .addFunction("content", static_cast<void (py_response::*)(const std::string&)> (&hi::py_response::content))
                     .addFunction("header", &hi::py_response::header)
                     .addFunction("session", &hi::py_response::session)
+                    .addFunction("del_session", &hi::py_response::del_session)
+                    .addStaticFunction("stream", &lua::stream)
                     );
+            lua_newtable(this->state.state());
+            this->bind("sleep", lua::l_sleep);
+            this->bind("redis", lua::l_redis);
+            this->bind("subrequest", lua::l_subrequest);
+            lua_setglobal(this->state.state(), "hi");
+            this->state.dostring(std::string("package.preload['hi.ffi'] = function(...)\n").append(ffi::source).append("\nend"));
         }
 
         virtual~lua() {
-            this->res = 0;
+            for (auto& item : this->tasks) {
+                delete item.second;
+            }
         }
 
-        void set_req(py_request* req) {
-            this->state["hi_req"] = req;
+        enum status_t {
+            done, yielded, failed
+        };
+
+        /*
+         * A request running in its own coroutine. Tasks are kept for reuse
+         * once their coroutine has returned, together with the hi_req and
+         * hi_res objects bound to it.
+         */
+        struct task {
+            lua* owner = 0;
+            lua_State* co = 0;
+            int ref = LUA_NOREF;
+            py_request req;
+            py_response res;
+            hi_ffi_t ffi;
+            kaguya::LuaRef req_ref, res_ref;
+            // the request it runs for, NULL when there is none to wait on
+            void* data = 0;
+            // set while a call the module started has not returned yet
+            bool pending = false;
+            std::string loading;
+        };
+
+        /*
+         * Done by the module for hi.sleep, hi.redis and hi.subrequest. A call
+         * returns false when it can not be made, otherwise the module pushes
+         * the results onto the task's coroutine and resumes it later, never
+         * from within the call.
+         */
+        class io {
+        public:
+            io() = default;
+            virtual~io() = default;
+            virtual bool sleep(task* t, long msec) = 0;
+            virtual bool redis(task* t, const std::vector<std::string>& cmd) = 0;
+            virtual bool subrequest(task* t, const std::string& uri, const std::string& args) = 0;
+        };
+
+        void set_io(io* p) {
+            this->io_ = p;
         }
 
-        void set_res(py_response* res) {
-            this->state["hi_res"] = res;
+        // view, when there is one, is what hi.ffi reads the request from
+        task* acquire(request& req, response& res, void* data, request_view* view = 0) {
+            task* t;
+            if (this->idle.empty()) {
+                lua_State* L = this->state.state();
+                t = new task();
+                t->owner = this;
+                t->co = lua_newthread(L);
+                t->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+                t->req_ref = this->state.newRef(&t->req);
+                t->res_ref = this->state.newRef(&t->res);
+                this->tasks[t->co] = t;
+            } else {
+                t = this->idle.back();
+                this->idle.pop_back();
+            }
+            t->req.init(&req, view);
+            t->res.init(&res);
+            t->ffi.req = &req;
+            t->ffi.view = view;
+            t->ffi.res = &res;
+            t->data = data;
+            t->pending = false;
+            t->loading.clear();
+            return t;
         }
 
-        void call_script(const std::string& lua_script) {
-            if (access(lua_script.c_str(), F_OK) == 0) {
-                if (!this->state.dofile(lua_script)) {
-                    this->res->status(500);
-                    this->res->content(this->error_message);
+        /*
+         * A task whose coroutine is still suspended can not be reused, it
+         * is dropped, or only detached from its request while a call is
+         * pending and released again when that returns.
+         */
+        void release(task* t) {
+            if (t->pending) {
+                t->data = 0;
+                return;
+            }
+            if (lua_status(t->co) == 0) {
+                lua_settop(t->co, 0);
+                this->idle.push_back(t);
+                return;
+            }
+            this->tasks.erase(t->co);
+            luaL_unref(this->state.state(), LUA_REGISTRYINDEX, t->ref);
+            delete t;
+        }
+
+        /*
+         * The loaded chunk is kept until the file's inode, size or mtime
+         * changes, which is looked at again once valid seconds have passed.
+         * A chunk that returns a function runs once when it is loaded, after
+         * that only the function is called with hi_req and hi_res.
+         */
+        status_t start_script(task* t, const std::string& lua_script, time_t valid = 0) {
+            time_t now = time(NULL);
+            script_t& script = this->scripts[lua_script];
+            if (script.chunk.isNilref() || now - script.checked >= valid) {
+                struct stat st;
+                if (stat(lua_script.c_str(), &st) != 0) {
+                    this->scripts.erase(lua_script);
+                    return done;
+                }
+                script.checked = now;
+                if (script.chunk.isNilref() || st.st_ino != script.ino || st.st_size != script.size || st.st_mtime != script.mtime) {
+                    script.handler = kaguya::LuaRef();
+                    script.chunk = this->state.loadfile(lua_script);
+                    script.ino = st.st_ino;
+                    script.size = st.st_size;
+                    script.mtime = st.st_mtime;
                 }
             }
+            if (script.chunk.isNilref()) {
+                this->fail(t);
+                return failed;
+            }
+            if (script.handler.isNilref()) {
+                t->loading = lua_script;
+                script.chunk.push(t->co);
+                return this->resume(t, 0);
+            }
+            return this->call(t, script.handler);
+        }
+
+        status_t start_content(task* t, const std::string& lua_content) {
+            if (!this->load_content(lua_content)) {
+                this->fail(t);
+                return failed;
+            }
+            this->contents[lua_content].push(t->co);
+            return this->resume(t, 0);
         }
 
-        void call_content(const std::string& py_content) {
-            if (!this->state.dostring(py_content)) {
-                this->res->status(500);
-                this->res->content(this->error_message);
+        /*
+         * Runs the task's coroutine until it returns or yields, nargs values
+         * on its stack are handed to it as the results of the yielding call.
+         */
+        status_t resume(task* t, int nargs) {
+            lua_State* L = this->state.state();
+            t->req_ref.push(L);
+            lua_setglobal(L, "hi_req");
+            t->res_ref.push(L);
+            lua_setglobal(L, "hi_res");
+            ffi::running = &t->ffi;
+#if LUA_VERSION_NUM >= 504
+            int nres, rc = lua_resume(t->co, L, nargs, &nres);
+#elif LUA_VERSION_NUM >= 502
+            int rc = lua_resume(t->co, L, nargs);
+#else
+            int rc = lua_resume(t->co, nargs);
+#endif
+            ffi::running = 0;
+            if (rc == LUA_YIELD) {
+                return yielded;
             }
+            if (rc != 0) {
+                kaguya::ErrorHandler::handle(rc, t->co);
+                this->fail(t);
+                return failed;
+            }
+            if (!t->loading.empty()) {
+                std::string path;
+                path.swap(t->loading);
+                if (lua_gettop(t->co) > 0 && lua_type(t->co, 1) == LUA_TFUNCTION) {
+                    lua_settop(t->co, 1);
+                    kaguya::LuaRef handler(t->co, kaguya::StackTop());
+                    this->scripts[path].handler = handler;
+                    return this->call(t, handler);
+                }
+            }
+            return done;
         }
 
+        void call_script(request& req, response& res, const std::string& lua_script, time_t valid = 0) {
+            task* t = this->acquire(req, res, 0);
+            this->start_script(t, lua_script, valid);
+            this->release(t);
+        }
 
+        void call_content(request& req, response& res, const std::string& lua_content) {
+            task* t = this->acquire(req, res, 0);
+            this->start_content(t, lua_content);
+            this->release(t);
+        }
+
+        // loads lua_content ahead of the first call_content
+        bool load_content(const std::string& lua_content) {
+            if (this->contents.find(lua_content) == this->contents.end()) {
+                kaguya::LuaRef chunk = this->state.loadstring(lua_content);
+                if (chunk.isNilref()) {
+                    return false;
+                }
+                this->contents.insert(std::make_pair(lua_content, chunk));
+            }
+            return true;
+        }
+
+        /*
+         * hi_res:stream(fn[, length]) calls fn whenever the client can take
+         * more, until it returns nil. An error in fn, or a value that is
+         * neither a string nor nil, aborts the response.
+         */
+        static void stream(py_response* res, kaguya::LuaFunction fn, kaguya::optional<long long> length) {
+            res->stream([fn](response::writer & w) {
+                lua_State* L = fn.state();
+                fn.push(L);
+                if (lua_pcall(L, 0, 1, 0) != 0) {
+                    const char* err = lua_tostring(L, -1);
+                    std::string text(err ? err : "lua error");
+                    lua_pop(L, 1);
+                    throw std::runtime_error(text);
+                }
+                int type = lua_type(L, -1);
+                if (type == LUA_TSTRING) {
+                    size_t n;
+                    const char* data = lua_tolstring(L, -1, &n);
+                    w.write(data, n);
+                }
+                lua_pop(L, 1);
+                if (type != LUA_TSTRING && type != LUA_TNIL) {
+                    throw std::runtime_error("hi_res:stream fn returned neither a string nor nil");
+                }
+                return type == LUA_TSTRING;
+            }, length.value_or(-1));
+        }
 
     private:
+
+        struct script_t {
+            kaguya::LuaRef chunk, handler;
+            ino_t ino = 0;
+            off_t size = 0;
+            time_t mtime = 0, checked = 0;
+        };
+
+        status_t call(task* t, const kaguya::LuaRef& fn) {
+            lua_settop(t->co, 0);
+            fn.push(t->co);
+            t->req_ref.push(t->co);
+            t->res_ref.push(t->co);
+            return this->resume(t, 2);
+        }
+
+        void fail(task* t) {
+            t->res.status(500);
+            t->res.content(this->error_message);
+        }
+
+        task* current(lua_State* co) {
+            auto item = this->tasks.find(co);
+            return item == this->tasks.end() ? 0 : item->second;
+        }
+
+        void bind(const char* name, lua_CFunction fn) {
+            lua_State* L = this->state.state();
+            lua_pushlightuserdata(L, this);
+            lua_pushcclosure(L, fn, 1);
+            lua_setfield(L, -2, name);
+        }
+
+        // errors are raised outside of blocks holding c++ objects
+        static int l_sleep(lua_State* co) {
+            lua* self = (lua*) lua_touserdata(co, lua_upvalueindex(1));
+            task* t = self->current(co);
+            long msec = (long) luaL_checknumber(co, 1);
+            if (t == 0 || self->io_ == 0 || !self->io_->sleep(t, msec)) {
+                return luaL_error(co, "hi.sleep can not yield here");
+            }
+            return lua_yield(co, 0);
+        }
+
+        static int l_redis(lua_State* co) {
+            lua* self = (lua*) lua_touserdata(co, lua_upvalueindex(1));
+            task* t = self->current(co);
+            bool ok = false;
+            {
+                std::vector<std::string> cmd;
+                for (int i = 1, n = lua_gettop(co); i <= n; ++i) {
+                    size_t len;
+                    const char* arg = lua_tolstring(co, i, &len);
+                    if (arg == 0) {
+                        cmd.clear();
+                        break;
+                    }
+                    cmd.push_back(std::string(arg, len));
+                }
+                ok = !cmd.empty() && t && self->io_ && self->io_->redis(t, cmd);
+            }
+            if (!ok) {
+                return luaL_error(co, "hi.redis can not yield here");
+            }
+            return lua_yield(co, 0);
+        }
+
+        static int l_subrequest(lua_State* co) {
+            lua* self = (lua*) lua_touserdata(co, lua_upvalueindex(1));
+            task* t = self->current(co);
+            bool ok = false;
+            {
+                size_t len = 0, args_len = 0;
+                const char* uri = lua_tolstring(co, 1, &len), *args = lua_tolstring(co, 2, &args_len);
+                ok = uri && t && self->io_ && self->io_->subrequest(t, std::string(uri, len), args ? std::string(args, args_len) : std::string());
+            }
+            if (!ok) {
+                return luaL_error(co, "hi.subrequest can not yield here");
+            }
+            return lua_yield(co, 0);
+        }
+
         std::string error_message;
-        py_response * res;
         kaguya::State state;
+        std::unordered_map<std::string, script_t> scripts;
+        std::unordered_map<std::string, kaguya::LuaRef> contents;
+        std::unordered_map<lua_State*, task*> tasks;
+        std::vector<task*> idle;
+        io* io_;
     };
 }
 
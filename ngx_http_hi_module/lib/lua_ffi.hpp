@@ -0,0 +1,183 @@
+#ifndef LUA_FFI_HPP
+#define LUA_FFI_HPP
+
+#include <cstring>
+#include <string>
+#include "../include/request.hpp"
+#include "../include/request_view.hpp"
+#include "../include/response.hpp"
+
+/*
+ * A C ABI over the request and response of the running lua coroutine, for
+ * the LuaJIT FFI. Strings are handed out as pointer and length into memory
+ * that lives until the request is finalized, so LuaJIT can compile the
+ * calls into the traces of a handler. The nginx binary exports these
+ * symbols, ffi.C finds them once hi.ffi is required.
+ */
+
+struct hi_ffi_s {
+    hi::request* req;
+    hi::request_view* view;
+    hi::response* res;
+};
+
+typedef struct hi_ffi_s hi_ffi_t;
+
+typedef struct {
+    const char* data;
+    size_t len;
+} hi_str_t;
+
+namespace hi {
+    namespace ffi {
+
+        // set by lua::resume while a coroutine runs
+        static hi_ffi_t* running = 0;
+
+        inline void set(hi_str_t* out, const char* data, size_t len) {
+            out->data = data ? data : "";
+            out->len = len;
+        }
+
+        inline void set(hi_str_t* out, const string_view& str) {
+            set(out, str.data(), str.size());
+        }
+
+        inline void set(hi_str_t* out, const std::string& str) {
+            set(out, str.data(), str.size());
+        }
+
+        inline int find(const field_list& list, const char* key, size_t n, hi_str_t* out) {
+            string_view value;
+            if (!list.find(string_view(key, n), value)) {
+                return 0;
+            }
+            set(out, value);
+            return 1;
+        }
+
+        inline int find(const std::unordered_map<std::string, std::string>& map, const char* key, size_t n, hi_str_t* out) {
+            auto item = map.find(std::string(key, n));
+            if (item == map.end()) {
+                return 0;
+            }
+            set(out, item->second);
+            return 1;
+        }
+
+        // the module required as hi.ffi
+        static const char* source =
+                "local ffi = require('ffi')\n"
+                "ffi.cdef[[\n"
+                "typedef struct { const char *data; size_t len; } hi_str_t;\n"
+                "typedef struct hi_ffi_s hi_ffi_t;\n"
+                "hi_ffi_t *hi_ffi_current(void);\n"
+                "void hi_ffi_uri(hi_ffi_t *r, hi_str_t *out);\n"
+                "void hi_ffi_method(hi_ffi_t *r, hi_str_t *out);\n"
+                "void hi_ffi_client(hi_ffi_t *r, hi_str_t *out);\n"
+                "void hi_ffi_user_agent(hi_ffi_t *r, hi_str_t *out);\n"
+                "void hi_ffi_param(hi_ffi_t *r, hi_str_t *out);\n"
+                "void hi_ffi_body(hi_ffi_t *r, hi_str_t *out);\n"
+                "int hi_ffi_header(hi_ffi_t *r, const char *key, size_t n, hi_str_t *out);\n"
+                "int hi_ffi_form(hi_ffi_t *r, const char *key, size_t n, hi_str_t *out);\n"
+                "int hi_ffi_cookie(hi_ffi_t *r, const char *key, size_t n, hi_str_t *out);\n"
+                "int hi_ffi_session(hi_ffi_t *r, const char *key, size_t n, hi_str_t *out);\n"
+                "void hi_ffi_status(hi_ffi_t *r, int status);\n"
+                "void hi_ffi_set_header(hi_ffi_t *r, const char *key, size_t kn, const char *value, size_t vn);\n"
+                "int hi_ffi_append(hi_ffi_t *r, const char *data, size_t n);\n"
+                "]]\n"
+                "local C, out, string = ffi.C, ffi.new('hi_str_t[1]'), ffi.string\n"
+                "local function value() return string(out[0].data, out[0].len) end\n"
+                "return {\n"
+                "  current = function()\n"
+                "    local r = C.hi_ffi_current()\n"
+                "    if r == nil then error('hi.ffi is only usable while a request runs') end\n"
+                "    return r\n"
+                "  end,\n"
+                "  uri = function(r) C.hi_ffi_uri(r, out) return value() end,\n"
+                "  method = function(r) C.hi_ffi_method(r, out) return value() end,\n"
+                "  client = function(r) C.hi_ffi_client(r, out) return value() end,\n"
+                "  user_agent = function(r) C.hi_ffi_user_agent(r, out) return value() end,\n"
+                "  param = function(r) C.hi_ffi_param(r, out) return value() end,\n"
+                "  body = function(r) C.hi_ffi_body(r, out) return value() end,\n"
+                "  header = function(r, k) if C.hi_ffi_header(r, k, #k, out) ~= 0 then return value() end end,\n"
+                "  form = function(r, k) if C.hi_ffi_form(r, k, #k, out) ~= 0 then return value() end end,\n"
+                "  cookie = function(r, k) if C.hi_ffi_cookie(r, k, #k, out) ~= 0 then return value() end end,\n"
+                "  session = function(r, k) if C.hi_ffi_session(r, k, #k, out) ~= 0 then return value() end end,\n"
+                "  status = function(r, status) C.hi_ffi_status(r, status) end,\n"
+                "  set_header = function(r, k, v) C.hi_ffi_set_header(r, k, #k, v, #v) end,\n"
+                "  append = function(r, data) return C.hi_ffi_append(r, data, #data) ~= 0 end,\n"
+                "}\n";
+    }
+}
+
+extern "C" {
+
+    // the request of the running coroutine, NULL outside of one
+    hi_ffi_t* hi_ffi_current(void) {
+        return hi::ffi::running;
+    }
+
+    void hi_ffi_uri(hi_ffi_t* r, hi_str_t* out) {
+        hi::ffi::set(out, r->view ? r->view->uri() : hi::string_view(r->req->uri));
+    }
+
+    void hi_ffi_method(hi_ffi_t* r, hi_str_t* out) {
+        hi::ffi::set(out, r->view ? r->view->method() : hi::string_view(r->req->method));
+    }
+
+    void hi_ffi_client(hi_ffi_t* r, hi_str_t* out) {
+        hi::ffi::set(out, r->view ? r->view->client() : hi::string_view(r->req->client));
+    }
+
+    void hi_ffi_user_agent(hi_ffi_t* r, hi_str_t* out) {
+        hi::ffi::set(out, r->view ? r->view->user_agent() : hi::string_view(r->req->user_agent));
+    }
+
+    void hi_ffi_param(hi_ffi_t* r, hi_str_t* out) {
+        hi::ffi::set(out, r->view ? r->view->param() : hi::string_view(r->req->param));
+    }
+
+    void hi_ffi_body(hi_ffi_t* r, hi_str_t* out) {
+        hi::ffi::set(out, r->view ? r->view->body() : hi::string_view());
+    }
+
+    int hi_ffi_header(hi_ffi_t* r, const char* key, size_t n, hi_str_t* out) {
+        return r->view ? hi::ffi::find(r->view->headers(), key, n, out) : hi::ffi::find(r->req->headers, key, n, out);
+    }
+
+    int hi_ffi_form(hi_ffi_t* r, const char* key, size_t n, hi_str_t* out) {
+        return r->view ? hi::ffi::find(r->view->form(), key, n, out) : hi::ffi::find(r->req->form, key, n, out);
+    }
+
+    int hi_ffi_cookie(hi_ffi_t* r, const char* key, size_t n, hi_str_t* out) {
+        return r->view ? hi::ffi::find(r->view->cookies(), key, n, out) : hi::ffi::find(r->req->cookies, key, n, out);
+    }
+
+    int hi_ffi_session(hi_ffi_t* r, const char* key, size_t n, hi_str_t* out) {
+        return r->view ? hi::ffi::find(r->view->session(), key, n, out) : hi::ffi::find(r->req->session, key, n, out);
+    }
+
+    void hi_ffi_status(hi_ffi_t* r, int status) {
+        r->res->status = status;
+    }
+
+    void hi_ffi_set_header(hi_ffi_t* r, const char* key, size_t kn, const char* value, size_t vn) {
+        r->res->headers.insert(std::make_pair(std::string(key, kn), std::string(value, vn)));
+    }
+
+    // copies data to the end of the body, returns 0 when out of memory
+    int hi_ffi_append(hi_ffi_t* r, const char* data, size_t n) {
+        if (n == 0) {
+            return 1;
+        }
+        char* p = r->res->reserve(n);
+        if (p == NULL) {
+            return 0;
+        }
+        memcpy(p, data, n);
+        return 1;
+    }
+}
+
+#endif /* LUA_FFI_HPP */
@@ -2,7 +2,9 @@
 #define MODULE_CLASS_H
 
 #include <memory>
+#include <mutex>
 #include <string>
+#include <vector>
 #include <dlfcn.h>
 
 
@@ -12,15 +14,72 @@ namespace hi {
     class module_class {
     public:
 
-        module_class(std::string module_name) : ready(false), module(module_name) {
+        module_class(std::string module_name) : ready(false), view(false), module(module_name), error(), pool_size(0), idle(), mtx() {
             this->shared = std::make_shared<shared_obj>();
-            this->ready = this->shared->open_module(this->module);
+            this->ready = this->shared->open_module(this->module, this->error);
+            this->view = this->ready && this->shared->view && this->shared->view();
         }
 
         ~module_class() {
+            this->clear();
             if (ready)this->shared->close_module();
         }
 
+        /*
+         * Up to pool_size released instances are kept and handed out again
+         * instead of being destroyed, 0 creates one for every acquire.
+         */
+        void set_pool_size(size_t size) {
+            std::lock_guard<std::mutex> lock(this->mtx);
+            this->pool_size = size;
+        }
+
+        size_t get_pool_size() {
+            std::lock_guard<std::mutex> lock(this->mtx);
+            return this->pool_size;
+        }
+
+        T* acquire() {
+            if (!this->ready) {
+                return NULL;
+            }
+            {
+                std::lock_guard<std::mutex> lock(this->mtx);
+                if (!this->idle.empty()) {
+                    T* p = this->idle.back();
+                    this->idle.pop_back();
+                    return p;
+                }
+            }
+            return this->shared->create();
+        }
+
+        void release(T* p) {
+            {
+                std::lock_guard<std::mutex> lock(this->mtx);
+                if (this->idle.size() < this->pool_size) {
+                    this->idle.push_back(p);
+                    return;
+                }
+            }
+            this->shared->destroy(p);
+        }
+
+        template <typename Ctx>
+        bool init(const Ctx& ctx) {
+            if (this->ready && this->shared->init) {
+                return this->shared->init(ctx);
+            }
+            return true;
+        }
+
+        void fini() {
+            this->clear();
+            if (this->ready && this->shared->fini) {
+                this->shared->fini();
+            }
+        }
+
         template <typename... Args>
         std::shared_ptr<T> make_obj(Args... args) {
             if (!this->ready) {
@@ -34,23 +93,43 @@ namespace hi {
             );
         }
 
+        bool is_view()const {
+            return this->view;
+        }
+
         const std::string& get_module()const {
             return this->module;
         }
 
+        bool is_ready()const {
+            return this->ready;
+        }
+
+        // why the module could not be loaded
+        const std::string& get_error()const {
+            return this->error;
+        }
+
+        module_class(const module_class&) = delete;
+        module_class& operator=(const module_class&) = delete;
+
     private:
 
         struct shared_obj {
             typename T::create_t *create = NULL;
             typename T::destroy_t *destroy = NULL;
+            typename T::init_t *init = NULL;
+            typename T::fini_t *fini = NULL;
+            typename T::view_t *view = NULL;
             void * dll_handle = NULL;
 
-            bool open_module(std::string module) {
+            bool open_module(std::string module, std::string& error) {
                 {
 
                     this->dll_handle = dlopen(module.c_str(), RTLD_LAZY);
 
                     if (!this->dll_handle) {
+                        error = dlerror();
                         return false;
                     }
 
@@ -60,6 +139,7 @@ namespace hi {
                     this->create = (typename T::create_t*) dlsym(this->dll_handle, "create");
                     const char * err = dlerror();
                     if (err) {
+                        error = err;
                         this->close_module();
                         return false;
                     }
@@ -67,10 +147,26 @@ namespace hi {
                     this->destroy = (typename T::destroy_t*) dlsym(this->dll_handle, "destroy");
                     err = dlerror();
                     if (err) {
+                        error = err;
                         this->close_module();
                         return false;
                     }
 
+                    // a module built against other headers would corrupt the request and response
+                    typename T::abi_t *abi = (typename T::abi_t*) dlsym(this->dll_handle, "hi_abi_version");
+                    dlerror();
+                    if (abi == NULL || abi() != T::abi_version) {
+                        error = module + " was built against other servlet headers, it has to be rebuilt";
+                        this->close_module();
+                        return false;
+                    }
+
+                    // optional, prefixed as dlsym also looks into the module's dependencies
+                    this->init = (typename T::init_t*) dlsym(this->dll_handle, "hi_init");
+                    this->fini = (typename T::fini_t*) dlsym(this->dll_handle, "hi_fini");
+                    this->view = (typename T::view_t*) dlsym(this->dll_handle, "hi_view_servlet");
+                    dlerror();
+
                     return true;
                 }
             }
@@ -83,11 +179,28 @@ namespace hi {
                     }
                     if (this->create) create = NULL;
                     if (this->destroy) destroy = NULL;
+                    init = NULL;
+                    fini = NULL;
+                    view = NULL;
                 }
             }
         };
-        bool ready;
-        std::string module;
+        void clear() {
+            std::vector<T*> tmp;
+            {
+                std::lock_guard<std::mutex> lock(this->mtx);
+                tmp.swap(this->idle);
+            }
+            for (auto p : tmp) {
+                this->shared->destroy(p);
+            }
+        }
+
+        bool ready, view;
+        std::string module, error;
+        size_t pool_size;
+        std::vector<T*> idle;
+        std::mutex mtx;
         std::shared_ptr<shared_obj> shared;
     };
 
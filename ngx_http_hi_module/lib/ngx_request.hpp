@@ -0,0 +1,306 @@
+#ifndef NGX_REQUEST_HPP
+#define NGX_REQUEST_HPP
+
+#include <cctype>
+#include <string>
+#include <unordered_map>
+#include <sys/mman.h>
+#include "../include/request_view.hpp"
+#include "../include/multipart.hpp"
+#include "param.hpp"
+
+/*
+ * request_view over an nginx request, the nginx core headers must be
+ * included before this file. Parsed fields are kept in arrays from the
+ * request pool and point into the nginx buffers.
+ */
+
+namespace hi {
+
+    class ngx_request : public request_view {
+    public:
+
+        ngx_request(ngx_http_request_t *r, const std::unordered_map<std::string, std::string>* session_map = 0) :
+        r(r)
+        , session_map(session_map)
+        , h(NULL)
+        , f(NULL)
+        , c(NULL)
+        , s(NULL)
+        , b(NULL)
+        , whole()
+        , joined(false) {
+        }
+
+        virtual~ngx_request() = default;
+
+        string_view client() {
+            return view(this->r->connection->addr_text);
+        }
+
+        string_view user_agent() {
+            return this->r->headers_in.user_agent ? view(this->r->headers_in.user_agent->value) : string_view();
+        }
+
+        string_view method() {
+            return view(this->r->method_name);
+        }
+
+        string_view uri() {
+            return view(this->r->uri);
+        }
+
+        string_view param() {
+            return view(this->r->args);
+        }
+
+        field_list headers() {
+            if (this->h == NULL && (this->h = this->create(8)) != NULL) {
+                ngx_list_part_t *part = &this->r->headers_in.headers.part;
+                ngx_table_elt_t *th = (ngx_table_elt_t*) part->elts;
+                for (ngx_uint_t i = 0; /* void */; i++) {
+                    if (i >= part->nelts) {
+                        if (part->next == NULL) {
+                            break;
+                        }
+                        part = part->next;
+                        th = (ngx_table_elt_t*) part->elts;
+                        i = 0;
+                    }
+                    field* p = (field*) ngx_array_push(this->h);
+                    if (p == NULL) {
+                        break;
+                    }
+                    p->key = view(th[i].key);
+                    p->value = view(th[i].value);
+                }
+            }
+            return list(this->h);
+        }
+
+        field_list form() {
+            if (this->f == NULL && (this->f = this->create(8)) != NULL) {
+                this->split(this->f, this->param(), '&', '=', true);
+                string_view type = this->content_type();
+                if (starts_with(type, "application/x-www-form-urlencoded")) {
+                    this->split(this->f, this->body(), '&', '=', true);
+                } else if (starts_with(type, "multipart/form-data")) {
+                    this->fields(this->f);
+                }
+            }
+            return list(this->f);
+        }
+
+        field_list cookies() {
+            if (this->c == NULL && (this->c = this->create(4)) != NULL) {
+                ngx_table_elt_t ** cookies = (ngx_table_elt_t **) this->r->headers_in.cookies.elts;
+                for (ngx_uint_t i = 0; i < this->r->headers_in.cookies.nelts; ++i) {
+                    if (cookies[i]->value.data != NULL) {
+                        this->split(this->c, view(cookies[i]->value), ';', '=', false);
+                    }
+                }
+            }
+            return list(this->c);
+        }
+
+        field_list session() {
+            if (this->s == NULL && this->session_map && (this->s = this->create(this->session_map->size() + 1)) != NULL) {
+                for (const auto& item : *this->session_map) {
+                    field* p = (field*) ngx_array_push(this->s);
+                    if (p == NULL) {
+                        break;
+                    }
+                    p->key = item.first;
+                    p->value = item.second;
+                }
+            }
+            return list(this->s);
+        }
+
+        string_view content_type() {
+            return this->r->headers_in.content_type ? view(this->r->headers_in.content_type->value) : string_view();
+        }
+
+        /*
+         * Memory buffers are used in place and a body in a temporary file
+         * is mapped. Only a body that arrived in several memory buffers,
+         * at most client_body_buffer_size, is joined in the request pool.
+         */
+        string_view body() {
+            if (!this->joined) {
+                this->joined = true;
+                chunk_list chunks = this->body_chunks();
+                if (chunks.size() == 1) {
+                    this->whole = *chunks.begin();
+                } else if (chunks.size() > 1) {
+                    size_t len = 0;
+                    for (const string_view& item : chunks) {
+                        len += item.size();
+                    }
+                    u_char *data = (u_char*) ngx_pnalloc(this->r->pool, len), *p = data;
+                    if (data) {
+                        for (const string_view& item : chunks) {
+                            p = ngx_cpymem(p, item.data(), item.size());
+                        }
+                        this->whole = string_view((const char*) data, len);
+                    }
+                }
+            }
+            return this->whole;
+        }
+
+        chunk_list body_chunks() {
+            ngx_http_request_body_t *rb = this->r->request_body;
+            if (this->b == NULL && rb && (this->b = ngx_array_create(this->r->pool, 2, sizeof (string_view))) != NULL) {
+                for (ngx_chain_t *cl = rb->bufs; cl; cl = cl->next) {
+                    string_view chunk;
+                    if (ngx_buf_in_memory(cl->buf)) {
+                        chunk = string_view((const char*) cl->buf->pos, cl->buf->last - cl->buf->pos);
+                    } else if (cl->buf->in_file) {
+                        chunk = this->map(cl->buf);
+                    }
+                    string_view* p;
+                    if (!chunk.empty() && (p = (string_view*) ngx_array_push(this->b)) != NULL) {
+                        *p = chunk;
+                    }
+                }
+            }
+            return this->b ? chunk_list((const string_view*) this->b->elts, this->b->nelts) : chunk_list();
+        }
+
+        /*
+         * Parses everything up front, for servlets that run off the event
+         * loop and must not allocate from the request pool.
+         */
+        void parse_all() {
+            this->headers();
+            this->form();
+            this->cookies();
+            this->session();
+            this->body();
+        }
+
+    private:
+
+        static string_view view(const ngx_str_t& str) {
+            return string_view((const char*) str.data, str.len);
+        }
+
+        static field_list list(ngx_array_t *a) {
+            return a ? field_list((const field*) a->elts, a->nelts) : field_list();
+        }
+
+        static string_view trim(string_view str) {
+            const char *b = str.begin(), *e = str.end();
+            while (b != e && isspace((unsigned char) *b)) {
+                ++b;
+            }
+            while (e != b && isspace((unsigned char) e[-1])) {
+                --e;
+            }
+            return string_view(b, e - b);
+        }
+
+        static bool starts_with(const string_view& str, const char* prefix) {
+            size_t n = strlen(prefix);
+            return str.size() >= n && ngx_strncasecmp((u_char*) str.data(), (u_char*) prefix, n) == 0;
+        }
+
+        struct mapping_t {
+            void* addr;
+            size_t len;
+        };
+
+        static void unmap(void* data) {
+            mapping_t* m = (mapping_t*) data;
+            munmap(m->addr, m->len);
+        }
+
+        // falls back to reading into the pool when the file cannot be mapped
+        string_view map(ngx_buf_t *buf) {
+            if (buf->file_last <= buf->file_pos) {
+                return string_view();
+            }
+            off_t start = buf->file_pos - buf->file_pos % (off_t) ngx_pagesize;
+            size_t len = buf->file_last - start, skip = buf->file_pos - start;
+            ngx_pool_cleanup_t *cln = ngx_pool_cleanup_add(this->r->pool, sizeof (mapping_t));
+            if (cln) {
+                void* addr = mmap(NULL, len, PROT_READ, MAP_PRIVATE, buf->file->fd, start);
+                if (addr != MAP_FAILED) {
+                    mapping_t* m = (mapping_t*) cln->data;
+                    m->addr = addr;
+                    m->len = len;
+                    cln->handler = unmap;
+                    return string_view((const char*) addr + skip, len - skip);
+                }
+            }
+            u_char *data = (u_char*) ngx_pnalloc(this->r->pool, len - skip);
+            if (data == NULL || ngx_read_file(buf->file, data, len - skip, buf->file_pos) != (ssize_t) (len - skip)) {
+                return string_view();
+            }
+            return string_view((const char*) data, len - skip);
+        }
+
+        // the fields of a multipart body that are not files
+        void fields(ngx_array_t *a) {
+            std::string value;
+            read_multipart(*this, [&value](const multipart::part&) {
+                value.clear();
+            }, [&value](const multipart::part& p, const string_view & data) {
+                if (p.filename.empty()) {
+                    value.append(data.data(), data.size());
+                }
+            }, [this, a, &value](const multipart::part & p) {
+                field* pf;
+                if (p.filename.empty() && (pf = (field*) ngx_array_push(a)) != NULL) {
+                    pf->key = this->copy(p.name);
+                    pf->value = this->copy(value);
+                }
+            });
+        }
+
+        string_view copy(const std::string& str) {
+            u_char *data = (u_char*) ngx_pnalloc(this->r->pool, str.size() + 1);
+            if (data == NULL) {
+                return string_view();
+            }
+            ngx_memcpy(data, str.data(), str.size());
+            return string_view((const char*) data, str.size());
+        }
+
+        ngx_array_t* create(size_t n) {
+            return ngx_array_create(this->r->pool, n, sizeof (field));
+        }
+
+        // same rules as hi::parser_param, cookies are left as they are
+        void split(ngx_array_t *a, string_view data, char c, char cc, bool decode) {
+            split_param(data, c, cc, [this, a, decode](const string_view& key, const string_view & value) {
+                field* pf = (field*) ngx_array_push(a);
+                if (pf) {
+                    pf->key = decode ? this->unescape(trim(key)) : trim(key);
+                    pf->value = decode ? this->unescape(trim(value)) : trim(value);
+                }
+            });
+        }
+
+        // only what has escapes is decoded into the pool
+        string_view unescape(const string_view& str) {
+            if (find_either(str.begin(), str.end(), '%', '+') == str.end()) {
+                return str;
+            }
+            char* data = (char*) ngx_pnalloc(this->r->pool, str.size());
+            if (data == NULL) {
+                return str;
+            }
+            return string_view(data, percent_decode(str.data(), str.size(), data));
+        }
+
+        ngx_http_request_t *r;
+        const std::unordered_map<std::string, std::string>* session_map;
+        ngx_array_t *h, *f, *c, *s, *b;
+        string_view whole;
+        bool joined;
+    };
+}
+
+#endif /* NGX_REQUEST_HPP */
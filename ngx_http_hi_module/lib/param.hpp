@@ -2,12 +2,18 @@
 #define PARAM_HPP
 
 
+#include <cctype>
+#include <cstring>
 #include <string>
 #include <unordered_map>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+#include "../include/string_view.hpp"
 
 namespace hi {
 
-    static std::string trim(const std::string& s) {
+    inline std::string trim(const std::string& s) {
         auto it = s.begin();
         while (it != s.end() && isspace(*it)) {
             it++;
@@ -19,27 +25,102 @@ namespace hi {
         return std::string(it, rit.base());
     }
 
-    static void parser_param(const std::string& data, std::unordered_map<std::string, std::string>& result, char c = '&', char cc = '=') {
-        if (data.empty())return;
-        size_t start = 0, p, q;
-        while (true) {
-            p = data.find(c, start);
-            if (p == std::string::npos) {
-                q = data.find(cc, start);
-                if (q != std::string::npos) {
-                    result[trim(data.substr(start, q - start))] = std::move(trim(data.substr(q + 1)));
-                }
+    /*
+     * The first a or b in [p, e), or e, looked for 32 or 16 bytes at a time
+     * where the target has AVX2 or SSE2.
+     */
+    inline const char* find_either(const char* p, const char* e, char a, char b) {
+#if defined(__AVX2__)
+        const __m256i ya = _mm256_set1_epi8(a), yb = _mm256_set1_epi8(b);
+        for (; e - p >= 32; p += 32) {
+            __m256i v = _mm256_loadu_si256((const __m256i*) p);
+            unsigned mask = (unsigned) _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(v, ya), _mm256_cmpeq_epi8(v, yb)));
+            if (mask) {
+                return p + __builtin_ctz(mask);
+            }
+        }
+#endif
+#if defined(__SSE2__)
+        const __m128i xa = _mm_set1_epi8(a), xb = _mm_set1_epi8(b);
+        for (; e - p >= 16; p += 16) {
+            __m128i v = _mm_loadu_si128((const __m128i*) p);
+            unsigned mask = (unsigned) _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, xa), _mm_cmpeq_epi8(v, xb)));
+            if (mask) {
+                return p + __builtin_ctz(mask);
+            }
+        }
+#endif
+        for (; p != e; ++p) {
+            if (*p == a || *p == b) {
+                return p;
+            }
+        }
+        return e;
+    }
+
+    inline int unhex(char c) {
+        return c <= '9' ? c - '0' : (c | 0x20) - 'a' + 10;
+    }
+
+    /*
+     * Decodes %XX, and + when plus is set, from src into dst and returns the
+     * decoded length. dst may be src, a % that is not followed by two hex
+     * digits is kept as it is.
+     */
+    inline size_t percent_decode(const char* src, size_t n, char* dst, bool plus = true) {
+        const char* e = src + n;
+        char* q = dst;
+        while (src != e) {
+            const char* p = find_either(src, e, '%', plus ? '+' : '%');
+            if (q != src) {
+                memmove(q, src, p - src);
+            }
+            q += p - src;
+            src = p;
+            if (p == e) {
                 break;
+            }
+            if (*p == '+') {
+                *q++ = ' ';
+                ++src;
+            } else if (e - p >= 3 && isxdigit((unsigned char) p[1]) && isxdigit((unsigned char) p[2])) {
+                *q++ = (char) (unhex(p[1]) << 4 | unhex(p[2]));
+                src += 3;
             } else {
-                q = data.find(cc, start);
-                if (q != std::string::npos) {
-                    result[trim(data.substr(start, q - start))] = std::move(trim(data.substr(q + 1, p - q - 1)));
-                }
-                start = p + 1;
+                *q++ = '%';
+                ++src;
+            }
+        }
+        return q - dst;
+    }
+
+    /*
+     * Calls fn(key, value) for every key=value item of data in one pass,
+     * items are split at sep and those without eq are skipped.
+     */
+    template<class F>
+    void split_param(const string_view& data, char sep, char eq, F fn) {
+        const char* p = data.begin(), *e = data.end();
+        while (p < e) {
+            const char* k = find_either(p, e, sep, eq);
+            if (k == e || *k == sep) {
+                p = k + 1;
+                continue;
+            }
+            const char* v = (const char*) memchr(k + 1, sep, e - k - 1);
+            if (v == NULL) {
+                v = e;
             }
+            fn(string_view(p, k - p), string_view(k + 1, v - k - 1));
+            p = v + 1;
         }
     }
+
+    inline void parser_param(const std::string& data, std::unordered_map<std::string, std::string>& result, char c = '&', char cc = '=') {
+        split_param(data, c, cc, [&result](const string_view& key, const string_view & value) {
+            result[trim(key.to_string())] = trim(value.to_string());
+        });
+    }
 }
 
 #endif /* PARAM_HPP */
-
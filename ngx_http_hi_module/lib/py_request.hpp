@@ -3,6 +3,7 @@
 
 
 #include "../include/request.hpp"
+#include "../include/request_view.hpp"
 
 namespace hi {
 
@@ -10,16 +11,28 @@ namespace hi {
     public:
 
         py_request()
-        : req(0) {
+        : req(0)
+        , view(0) {
 
         }
 
         virtual~py_request() {
             this->req = 0;
+            this->view = 0;
         }
 
-        void init(request* req) {
+        // view, when there is one, gives access to the body
+        void init(request* req, request_view* view = 0) {
             this->req = req;
+            this->view = view;
+        }
+
+        const request& fields()const {
+            return *this->req;
+        }
+
+        string_view body()const {
+            return this->view ? this->view->body() : string_view();
         }
 
         std::string uri()const {
@@ -75,6 +88,7 @@ namespace hi {
         }
     private:
         request* req;
+        request_view* view;
     };
 }
 
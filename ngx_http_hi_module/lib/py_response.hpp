@@ -2,6 +2,7 @@
 #define PY_RESPONSE_HPP
 
 
+#include <memory>
 #include "../include/response.hpp"
 
 namespace hi {
@@ -27,6 +28,14 @@ namespace hi {
 
         void content(const std::string& content) {
             this->res->content = content;
+            this->res->parts.clear();
+        }
+
+        // the body becomes the n bytes at data, which owner keeps alive
+        void content(const char* data, size_t n, const std::shared_ptr<const void>& owner) {
+            this->res->content.clear();
+            this->res->parts.clear();
+            this->res->attach(data, n, owner);
         }
 
         void header(const std::string& key, const std::string& value) {
@@ -34,7 +43,17 @@ namespace hi {
         }
 
         void session(const std::string& key, const std::string& value) {
-            this->res->session.insert(std::make_pair(key, value));
+            this->res->session[key] = value;
+            this->res->session_deleted.erase(key);
+        }
+
+        void del_session(const std::string& key) {
+            this->res->session.erase(key);
+            this->res->session_deleted.insert(key);
+        }
+
+        void stream(const response::producer_t& fn, long long length = -1) {
+            this->res->stream(fn, length);
         }
     private:
         response* res;
@@ -3,11 +3,65 @@
 
 #include <string>
 #include <vector>
+#include <memory>
+#include <initializer_list>
 #include <unordered_map>
 #include <hiredis/hiredis.h>
 
 namespace hi {
 
+    class redis_batch {
+    public:
+        typedef std::vector<std::string> command_t;
+
+        redis_batch() :
+        replies()
+        , cmds() {
+        }
+
+        virtual~redis_batch() = default;
+
+        redis_batch& add(command_t&& argv) {
+            this->cmds.push_back(std::move(argv));
+            return *this;
+        }
+
+        redis_batch& add(std::initializer_list<std::string> argv) {
+            this->cmds.push_back(command_t(argv));
+            return *this;
+        }
+
+        size_t size()const {
+            return this->cmds.size();
+        }
+
+        bool empty()const {
+            return this->cmds.empty();
+        }
+
+        void clear() {
+            this->cmds.clear();
+            this->replies.clear();
+        }
+
+        const std::vector<command_t>& commands()const {
+            return this->cmds;
+        }
+
+        static void to_argv(const command_t& cmd, std::vector<const char*>& argv, std::vector<size_t>& argvlen) {
+            argv.clear();
+            argvlen.clear();
+            for (const auto& item : cmd) {
+                argv.push_back(item.data());
+                argvlen.push_back(item.size());
+            }
+        }
+
+        std::vector<std::shared_ptr<redisReply>> replies;
+    private:
+        std::vector<command_t> cmds;
+    };
+
     class redis {
     public:
 
@@ -215,20 +269,21 @@ namespace hi {
         }
 
         void hmset(const std::string& key, const std::unordered_map<std::string, std::string>& kvlist) {
-            std::string cmd("HMSET " + key + " ");
+            if (kvlist.empty()) {
+                return;
+            }
+            redis_batch::command_t cmd{"HMSET", key};
             for (const auto& item : kvlist) {
-                cmd.append(item.first + " " + item.second + " ");
+                cmd.push_back(item.first);
+                cmd.push_back(item.second);
             }
-            redisReply* reply = (redisReply*) redisCommand(this->content, cmd.c_str());
-            freeReplyObject(reply);
+            freeReplyObject(this->command_argv(cmd));
         }
 
         void hmget(const std::string& key, std::vector<std::string>& flist) {
-            std::string cmd("HMGET " + key + " ");
-            for (const auto& item : flist) {
-                cmd.append(item + " ");
-            }
-            redisReply* reply = (redisReply*) redisCommand(this->content, cmd.c_str());
+            redis_batch::command_t cmd{"HMGET", key};
+            cmd.insert(cmd.end(), flist.begin(), flist.end());
+            redisReply* reply = this->command_argv(cmd);
             std::string v;
             for (size_t i = 0; i < reply->elements; ++i) {
                 flist[i] = v.assign(reply->element[i]->str, reply->element[i]->len);
@@ -237,12 +292,9 @@ namespace hi {
         }
 
         void lpush(const std::string& key, const std::vector<std::string>& vlist) {
-            std::string cmd("LPUSH " + key + " ");
-            for (const auto& item : vlist) {
-                cmd.append(item + " ");
-            }
-            redisReply* reply = (redisReply*) redisCommand(this->content, cmd.c_str());
-            freeReplyObject(reply);
+            redis_batch::command_t cmd{"LPUSH", key};
+            cmd.insert(cmd.end(), vlist.begin(), vlist.end());
+            freeReplyObject(this->command_argv(cmd));
         }
 
         std::string lpop(const std::string& key) {
@@ -282,12 +334,9 @@ namespace hi {
         }
 
         void rpush(const std::string& key, const std::vector<std::string>& vlist) {
-            std::string cmd("RPUSH " + key + " ");
-            for (const auto& item : vlist) {
-                cmd.append(item + " ");
-            }
-            redisReply* reply = (redisReply*) redisCommand(this->content, cmd.c_str());
-            freeReplyObject(reply);
+            redis_batch::command_t cmd{"RPUSH", key};
+            cmd.insert(cmd.end(), vlist.begin(), vlist.end());
+            freeReplyObject(this->command_argv(cmd));
         }
 
         std::string rpop(const std::string& key) {
@@ -302,7 +351,35 @@ namespace hi {
             redisReply* reply = (redisReply*) redisCommand(this->content, "RENAME %s %s", old_key.c_str(), new_key.c_str());
             freeReplyObject(reply);
         }
+
+        bool flush(redis_batch& batch) {
+            std::vector<const char*> argv;
+            std::vector<size_t> argvlen;
+            batch.replies.clear();
+            for (const auto& cmd : batch.commands()) {
+                redis_batch::to_argv(cmd, argv, argvlen);
+                if (redisAppendCommandArgv(this->content, (int) argv.size(), argv.data(), argvlen.data()) != REDIS_OK) {
+                    return false;
+                }
+            }
+            for (size_t i = 0; i < batch.size(); ++i) {
+                void* reply = 0;
+                if (redisGetReply(this->content, &reply) != REDIS_OK) {
+                    return false;
+                }
+                batch.replies.push_back(std::shared_ptr<redisReply>((redisReply*) reply, freeReplyObject));
+            }
+            return true;
+        }
     private:
+
+        redisReply* command_argv(const redis_batch::command_t& cmd) {
+            std::vector<const char*> argv;
+            std::vector<size_t> argvlen;
+            redis_batch::to_argv(cmd, argv, argvlen);
+            return (redisReply*) redisCommandArgv(this->content, (int) argv.size(), argv.data(), argvlen.data());
+        }
+
         redisContext* content;
         std::string host;
         int port;
@@ -0,0 +1,216 @@
+#ifndef REDIS_ASYNC_HPP
+#define REDIS_ASYNC_HPP
+
+#include <ctime>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <hiredis/hiredis.h>
+#include <hiredis/async.h>
+#include "redis.hpp"
+
+/*
+ * hiredis async client driven by the nginx event loop, the nginx core
+ * headers must be included before this file.
+ */
+
+namespace hi {
+
+    class redis_async {
+    public:
+
+        redis_async() :
+        context(0)
+        , failed_at(0)
+        , tracking(0)
+        , host()
+        , port(0) {
+        }
+
+        virtual~redis_async() {
+            if (this->context) {
+                this->context->data = 0;
+                redisAsyncFree(this->context);
+            }
+        }
+
+        bool connect(const std::string& host = "127.0.0.1", int port = 6379) {
+            this->host = host;
+            this->port = port;
+            return this->reconnect();
+        }
+
+        bool reconnect() {
+            if (this->context) {
+                return true;
+            }
+            this->context = redisAsyncConnect(this->host.c_str(), this->port);
+            if (this->context == 0) {
+                this->failed_at = time(NULL);
+                return false;
+            }
+            if (this->context->err || !this->attach()) {
+                redisAsyncFree(this->context);
+                this->context = 0;
+                this->failed_at = time(NULL);
+                return false;
+            }
+            this->context->data = this;
+            this->tracking = 0;
+            redisAsyncSetConnectCallback(this->context, redis_async::on_connect);
+            redisAsyncSetDisconnectCallback(this->context, redis_async::on_disconnect);
+            return true;
+        }
+
+        bool is_connected()const {
+            return this->context != 0;
+        }
+
+        time_t failed()const {
+            return this->failed_at;
+        }
+
+        /*
+         * Tag of the invalidation channel this connection reports to, reset
+         * whenever the connection is reopened.
+         */
+        uint64_t tracked()const {
+            return this->tracking;
+        }
+
+        void track(uint64_t tag) {
+            this->tracking = tag;
+        }
+
+        /*
+         * fn is called once with the reply, or with NULL when the connection
+         * fails. When the client itself is being destroyed ac->data is NULL,
+         * fn must then not use the client, nor privdata that the client owns.
+         */
+        bool command(redisCallbackFn* fn, void* privdata, const redis_batch::command_t& cmd) {
+            if (this->context == 0 && !this->reconnect()) {
+                return false;
+            }
+            std::vector<const char*> argv;
+            std::vector<size_t> argvlen;
+            redis_batch::to_argv(cmd, argv, argvlen);
+            return redisAsyncCommandArgv(this->context, fn, privdata, (int) argv.size(), argv.data(), argvlen.data()) == REDIS_OK;
+        }
+
+        /*
+         * Queues every command of the batch in one write, fn receives the
+         * reply of the last command.
+         */
+        bool flush(redisCallbackFn* fn, void* privdata, const redis_batch& batch) {
+            if (batch.empty() || (this->context == 0 && !this->reconnect())) {
+                return false;
+            }
+            std::vector<const char*> argv;
+            std::vector<size_t> argvlen;
+            size_t last = batch.size() - 1;
+            for (size_t i = 0; i <= last; ++i) {
+                redis_batch::to_argv(batch.commands()[i], argv, argvlen);
+                if (redisAsyncCommandArgv(this->context, i == last ? fn : NULL, i == last ? privdata : NULL
+                        , (int) argv.size(), argv.data(), argvlen.data()) != REDIS_OK) {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+    private:
+
+        bool attach() {
+            ngx_connection_t *c = ngx_get_connection(this->context->c.fd, ngx_cycle->log);
+            if (c == NULL) {
+                return false;
+            }
+            c->data = this->context;
+            c->read->log = c->log;
+            c->write->log = c->log;
+            c->read->handler = redis_async::read_handler;
+            c->write->handler = redis_async::write_handler;
+            this->context->ev.data = c;
+            this->context->ev.addRead = redis_async::add_read;
+            this->context->ev.delRead = redis_async::del_read;
+            this->context->ev.addWrite = redis_async::add_write;
+            this->context->ev.delWrite = redis_async::del_write;
+            this->context->ev.cleanup = redis_async::cleanup;
+            return true;
+        }
+
+        static void read_handler(ngx_event_t *ev) {
+            ngx_connection_t *c = (ngx_connection_t*) ev->data;
+            redisAsyncHandleRead((redisAsyncContext*) c->data);
+        }
+
+        static void write_handler(ngx_event_t *ev) {
+            ngx_connection_t *c = (ngx_connection_t*) ev->data;
+            redisAsyncHandleWrite((redisAsyncContext*) c->data);
+        }
+
+        static void add_read(void *privdata) {
+            ngx_connection_t *c = (ngx_connection_t*) privdata;
+            if (!c->read->active) {
+                ngx_add_event(c->read, NGX_READ_EVENT, NGX_LEVEL_EVENT);
+            }
+        }
+
+        static void del_read(void *privdata) {
+            ngx_connection_t *c = (ngx_connection_t*) privdata;
+            if (c->read->active) {
+                ngx_del_event(c->read, NGX_READ_EVENT, 0);
+            }
+        }
+
+        static void add_write(void *privdata) {
+            ngx_connection_t *c = (ngx_connection_t*) privdata;
+            if (!c->write->active) {
+                ngx_add_event(c->write, NGX_WRITE_EVENT, NGX_LEVEL_EVENT);
+            }
+        }
+
+        static void del_write(void *privdata) {
+            ngx_connection_t *c = (ngx_connection_t*) privdata;
+            if (c->write->active) {
+                ngx_del_event(c->write, NGX_WRITE_EVENT, 0);
+            }
+        }
+
+        static void cleanup(void *privdata) {
+            ngx_connection_t *c = (ngx_connection_t*) privdata;
+            if (c) {
+                del_read(c);
+                del_write(c);
+                ngx_free_connection(c);
+            }
+        }
+
+        static void on_connect(const redisAsyncContext *ac, int status) {
+            redis_async* self = (redis_async*) ac->data;
+            if (status != REDIS_OK && self) {
+                ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0, "redis connect to %s:%d failed: %s", self->host.c_str(), self->port, ac->errstr);
+                self->context = 0;
+                self->failed_at = time(NULL);
+            }
+        }
+
+        static void on_disconnect(const redisAsyncContext *ac, int status) {
+            redis_async* self = (redis_async*) ac->data;
+            if (self) {
+                self->context = 0;
+                if (status != REDIS_OK) {
+                    self->failed_at = time(NULL);
+                }
+            }
+        }
+
+        redisAsyncContext* context;
+        time_t failed_at;
+        uint64_t tracking;
+        std::string host;
+        int port;
+    };
+}
+
+#endif /* REDIS_ASYNC_HPP */
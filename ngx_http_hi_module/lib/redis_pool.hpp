@@ -0,0 +1,313 @@
+#ifndef REDIS_POOL_HPP
+#define REDIS_POOL_HPP
+
+#include <ctime>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <memory>
+#include <utility>
+#include <algorithm>
+#include <functional>
+#include "hash.hpp"
+#include "redis_async.hpp"
+
+namespace hi {
+
+    /*
+     * A named group of redis servers. Keys are spread over the servers with a
+     * consistent hash ring, every server has its own small set of connections
+     * that are used round robin and reopened once fail_timeout has passed
+     * since the last failure.
+     */
+    class redis_pool {
+    public:
+        /*
+         * Called with the key that was changed on the server, or with NULL
+         * when every key read so far has to be considered stale.
+         */
+        typedef std::function<void(const std::string*) > invalidate_fn;
+
+        redis_pool(const std::string& name, size_t pool_size = 1, time_t fail_timeout = 10) :
+        name(name)
+        , pool_size(pool_size ? pool_size : 1)
+        , fail_timeout(fail_timeout)
+        , epochs(0)
+        , servers()
+        , ring()
+        , on_invalidate() {
+        }
+
+        virtual~redis_pool() = default;
+
+        void add_server(const std::string& host, int port) {
+            std::shared_ptr<server_t> server = std::make_shared<server_t>();
+            server->pool = this;
+            server->host = host;
+            server->port = port;
+            server->next = 0;
+            server->next_plain = 0;
+            server->state = watch_idle;
+            server->epoch = 0;
+            for (size_t i = 0; i < this->pool_size; ++i) {
+                server->conns.push_back(std::make_shared<redis_async>());
+                server->plain.push_back(std::make_shared<redis_async>());
+            }
+            this->servers.push_back(server);
+
+            std::string point = host + ":" + std::to_string(port) + "-";
+            for (size_t i = 0; i < 160; ++i) {
+                std::string vnode = point + std::to_string(i);
+                this->ring.push_back(std::make_pair(cache::hash128(vnode.data(), vnode.size()).lo, this->servers.size() - 1));
+            }
+            std::sort(this->ring.begin(), this->ring.end());
+        }
+
+        const std::string& get_name()const {
+            return this->name;
+        }
+
+        /*
+         * Opens one extra connection per server that receives invalidations,
+         * through CLIENT TRACKING on redis 6 and later, or keyspace
+         * notifications when the server has them enabled.
+         */
+        void watch(const invalidate_fn& fn) {
+            this->on_invalidate = fn;
+        }
+
+        /*
+         * tracked is set when the server will report later changes of the
+         * keys read through the returned connection.
+         */
+        redis_async* get(const std::string& key, bool* tracked = 0) {
+            return this->pick(key, false, tracked);
+        }
+
+        /*
+         * A connection for arbitrary commands, kept apart from the ones get
+         * hands out so nothing sent on it can change their tracking. They
+         * are only opened once asked for.
+         */
+        redis_async* get_plain(const std::string& key) {
+            return this->pick(key, true, 0);
+        }
+
+    private:
+
+        redis_async* pick(const std::string& key, bool plain, bool* tracked) {
+            if (tracked) {
+                *tracked = false;
+            }
+            if (this->ring.empty()) {
+                return 0;
+            }
+            std::pair<uint64_t, size_t> point(cache::hash128(key.data(), key.size()).lo, 0);
+            size_t i = std::lower_bound(this->ring.begin(), this->ring.end(), point) - this->ring.begin();
+            std::vector<bool> tried(this->servers.size(), false);
+            for (size_t n = 0; n < this->ring.size(); ++n) {
+                size_t s = this->ring[(i + n) % this->ring.size()].second;
+                if (tried[s]) {
+                    continue;
+                }
+                tried[s] = true;
+                redis_async* conn = plain ? this->available(*this->servers[s], this->servers[s]->plain, this->servers[s]->next_plain)
+                        : this->available(*this->servers[s], this->servers[s]->conns, this->servers[s]->next);
+                if (conn) {
+                    if (tracked) {
+                        *tracked = this->tracking(*this->servers[s], conn);
+                    }
+                    return conn;
+                }
+            }
+            return 0;
+        }
+
+        enum watch_state_t {
+            watch_idle, watch_probing, watch_ready, watch_off
+        };
+
+        struct server_t {
+            redis_pool* pool;
+            std::string host;
+            int port;
+            size_t next, next_plain;
+            std::vector<std::shared_ptr<redis_async>> conns, plain;
+            std::shared_ptr<redis_async> watcher;
+            watch_state_t state;
+            std::string client_id;
+            uint64_t epoch;
+        };
+
+        redis_async* available(server_t& server, std::vector<std::shared_ptr<redis_async>>& conns, size_t& next) {
+            time_t now = time(NULL);
+            for (size_t n = 0; n < conns.size(); ++n) {
+                redis_async* conn = conns[next++ % conns.size()].get();
+                if (conn->is_connected()) {
+                    return conn;
+                }
+                if (difftime(now, conn->failed()) >= this->fail_timeout && conn->connect(server.host, server.port)) {
+                    return conn;
+                }
+            }
+            return 0;
+        }
+
+        bool tracking(server_t& server, redis_async* conn) {
+            if (!this->on_invalidate) {
+                return false;
+            }
+            if (server.state == watch_idle) {
+                this->start_watch(server);
+            }
+            if (server.state != watch_ready) {
+                return false;
+            }
+            if (!server.client_id.empty() && conn->tracked() != server.epoch) {
+                if (!conn->command(redis_pool::on_tracking, &server,{"CLIENT", "TRACKING", "on", "REDIRECT", server.client_id, "NOLOOP"})) {
+                    return false;
+                }
+                conn->track(server.epoch);
+            }
+            return true;
+        }
+
+        /*
+         * Keys were read through the connection assuming it is tracked, when
+         * it is not they all have to be dropped and tracking tried again.
+         */
+        static void on_tracking(redisAsyncContext *ac, void *reply, void *privdata) {
+            redis_async* conn = (redis_async*) ac->data;
+            if (conn == NULL) {
+                return;
+            }
+            server_t* server = (server_t*) privdata;
+            redisReply *rep = (redisReply*) reply;
+            if (rep == NULL || rep->type == REDIS_REPLY_ERROR) {
+                ngx_log_error(NGX_LOG_WARN, ngx_cycle->log, 0, "redis %s:%d client tracking failed: %s", server->host.c_str(), server->port
+                        , rep ? rep->str : "connection lost");
+                conn->track(0);
+                server->pool->on_invalidate(NULL);
+            }
+        }
+
+        void start_watch(server_t& server) {
+            if (!server.watcher) {
+                server.watcher = std::make_shared<redis_async>();
+            }
+            if (!server.watcher->is_connected() && difftime(time(NULL), server.watcher->failed()) < this->fail_timeout) {
+                return;
+            }
+            if (server.watcher->connect(server.host, server.port)
+                    && server.watcher->command(redis_pool::on_probe, &server,{"CLIENT", "TRACKING", "off"})) {
+                server.state = watch_probing;
+            }
+        }
+
+        static void lost(server_t* server) {
+            server->state = watch_idle;
+            server->client_id.clear();
+            server->pool->on_invalidate(NULL);
+        }
+
+        static void on_probe(redisAsyncContext *ac, void *reply, void *privdata) {
+            if (ac->data == NULL) {
+                return;
+            }
+            server_t* server = (server_t*) privdata;
+            redisReply *rep = (redisReply*) reply;
+            if (rep == NULL) {
+                lost(server);
+            } else if (rep->type == REDIS_REPLY_ERROR) {
+                server->watcher->command(redis_pool::on_config, server,{"CONFIG", "GET", "notify-keyspace-events"});
+            } else {
+                server->watcher->command(redis_pool::on_client_id, server,{"CLIENT", "ID"});
+            }
+        }
+
+        static void on_client_id(redisAsyncContext *ac, void *reply, void *privdata) {
+            if (ac->data == NULL) {
+                return;
+            }
+            server_t* server = (server_t*) privdata;
+            redisReply *rep = (redisReply*) reply;
+            if (rep == NULL || rep->type != REDIS_REPLY_INTEGER) {
+                lost(server);
+                return;
+            }
+            server->client_id = std::to_string(rep->integer);
+            server->watcher->command(redis_pool::on_message, server,{"SUBSCRIBE", "__redis__:invalidate"});
+        }
+
+        static void on_config(redisAsyncContext *ac, void *reply, void *privdata) {
+            if (ac->data == NULL) {
+                return;
+            }
+            server_t* server = (server_t*) privdata;
+            redisReply *rep = (redisReply*) reply;
+            if (rep == NULL) {
+                lost(server);
+                return;
+            }
+            std::string flags;
+            if (rep->type == REDIS_REPLY_ARRAY && rep->elements == 2 && rep->element[1]->type == REDIS_REPLY_STRING) {
+                flags.assign(rep->element[1]->str, rep->element[1]->len);
+            }
+            if (flags.find('K') == std::string::npos || (flags.find('A') == std::string::npos
+                    && (flags.find('g') == std::string::npos || flags.find('h') == std::string::npos || flags.find('x') == std::string::npos))) {
+                ngx_log_error(NGX_LOG_WARN, ngx_cycle->log, 0, "redis %s:%d supports neither client tracking nor keyspace events, keys are not cached"
+                        , server->host.c_str(), server->port);
+                server->state = watch_off;
+                return;
+            }
+            server->watcher->command(redis_pool::on_message, server,{"PSUBSCRIBE", "__keyspace@*__:*"});
+        }
+
+        static void on_message(redisAsyncContext *ac, void *reply, void *privdata) {
+            if (ac->data == NULL) {
+                return;
+            }
+            server_t* server = (server_t*) privdata;
+            redisReply *rep = (redisReply*) reply;
+            if (rep == NULL) {
+                lost(server);
+                return;
+            }
+            if (rep->type != REDIS_REPLY_ARRAY || rep->elements < 3 || rep->element[0]->type != REDIS_REPLY_STRING) {
+                return;
+            }
+            const char* kind = rep->element[0]->str;
+            std::string key;
+            if (strcmp(kind, "subscribe") == 0 || strcmp(kind, "psubscribe") == 0) {
+                server->state = watch_ready;
+                server->epoch = ++server->pool->epochs;
+            } else if (strcmp(kind, "message") == 0) {
+                redisReply *keys = rep->element[2];
+                if (keys->type == REDIS_REPLY_ARRAY) {
+                    for (size_t i = 0; i < keys->elements; ++i) {
+                        server->pool->on_invalidate(&key.assign(keys->element[i]->str, keys->element[i]->len));
+                    }
+                } else {
+                    server->pool->on_invalidate(NULL);
+                }
+            } else if (strcmp(kind, "pmessage") == 0 && rep->elements == 4) {
+                const char* channel = rep->element[2]->str, *p = strstr(channel, "__:");
+                if (p) {
+                    p += 3;
+                    server->pool->on_invalidate(&key.assign(p, rep->element[2]->len - (p - channel)));
+                }
+            }
+        }
+
+        std::string name;
+        size_t pool_size;
+        time_t fail_timeout;
+        uint64_t epochs;
+        std::vector<std::shared_ptr<server_t>> servers;
+        std::vector<std::pair<uint64_t, size_t>> ring;
+        invalidate_fn on_invalidate;
+    };
+}
+
+#endif /* REDIS_POOL_HPP */
@@ -2,19 +2,22 @@ extern "C" {
 #include <ngx_config.h>
 #include <ngx_core.h>
 #include <ngx_http.h>
-#include <ngx_md5.h>
 }
 
 #include <vector>
 #include <memory>
+#include <algorithm>
 #include "include/request.hpp"
 #include "include/response.hpp"
 #include "include/servlet.hpp"
 
 #include "lib/module_class.hpp"
 #include "lib/lrucache.hpp"
-#include "lib/param.hpp"
+#include "lib/hash.hpp"
 #include "lib/redis.hpp"
+#include "lib/redis_async.hpp"
+#include "lib/redis_pool.hpp"
+#include "lib/ngx_request.hpp"
 #include "lib/py_request.hpp"
 #include "lib/py_response.hpp"
 #include "lib/boost_py.hpp"
@@ -22,20 +25,236 @@ extern "C" {
 
 
 #define SESSION_ID_NAME "SESSIONID"
-#define form_urlencoded_type "application/x-www-form-urlencoded"
-#define form_urlencoded_type_len (sizeof(form_urlencoded_type) - 1)
+#define STREAM_BUF_SIZE 16384
+#define STREAM_ROUNDS 16
+
+extern ngx_module_t ngx_http_hi_module;
 
 struct cache_ele_t {
     int status = 200;
     time_t t;
+    // while later, an expired entry is being refreshed by some request
+    time_t updating = 0;
     std::string header, content;
 };
 
+struct cache_ele_weigher {
+
+    size_t operator()(const cache::key128& key, const cache_ele_t& ele) const {
+        return sizeof (key) + ele.header.size() + ele.content.size();
+    }
+};
+
+typedef cache::lru_cache<cache::key128, cache_ele_t, cache::key128_hash, std::equal_to<cache::key128>, cache_ele_weigher> cache_t;
+
+struct session_ele_t {
+    time_t expires = 0;
+    std::unordered_map<std::string, std::string> data;
+};
+
+typedef cache::lru_cache<std::string, session_ele_t> session_cache_t;
+
+typedef struct {
+    ngx_rbtree_t rbtree;
+    ngx_rbtree_node_t sentinel;
+    ngx_queue_t queue;
+    size_t bytes;
+    ngx_uint_t entries;
+    ngx_uint_t evictions;
+} ngx_http_hi_cache_shctx_t;
+
+typedef struct {
+    ngx_http_hi_cache_shctx_t *sh;
+    ngx_slab_pool_t *shpool;
+} ngx_http_hi_cache_zone_ctx_t;
+
+typedef struct {
+    ngx_rbtree_node_t node;
+    ngx_queue_t queue;
+    u_char key[16];
+    time_t t;
+    time_t updating;
+    ngx_int_t status;
+    size_t header_len;
+    size_t content_len;
+    u_char data[1];
+} ngx_http_hi_cache_node_t;
+
 static std::vector<std::shared_ptr<hi::module_class<hi::servlet>>> PLUGIN;
-static std::vector<std::shared_ptr<cache::lru_cache<std::string, cache_ele_t>>> CACHE;
-static std::shared_ptr<hi::redis> REDIS;
-static std::shared_ptr<hi::boost_py> PYTHON;
-static std::shared_ptr<hi::lua> LUA;
+static std::vector<std::shared_ptr<cache_t>> CACHE;
+static std::vector<std::shared_ptr<hi::redis_pool>> REDIS;
+static std::vector<std::shared_ptr<session_cache_t>> SESSION;
+// requests of this worker waiting for an entry that another one is filling
+static std::unordered_map<cache::key128, std::vector<ngx_http_request_t*>, cache::key128_hash> CACHE_LOCK;
+#if (NGX_THREADS)
+
+typedef struct {
+    ngx_thread_pool_t *pool;
+    ngx_uint_t queued;
+    ngx_uint_t rejected;
+} ngx_http_hi_thread_pool_t;
+
+static std::vector<ngx_http_hi_thread_pool_t> THREAD_POOL;
+#endif
+// idle namespaces of every python location, only touched with the GIL held
+static std::vector<std::vector<std::shared_ptr<hi::boost_py>>> PYTHON;
+static std::vector<std::shared_ptr<hi::lua>> LUA;
+
+struct ngx_http_hi_pool_allocator : public hi::response::allocator {
+
+    ngx_http_hi_pool_allocator(ngx_pool_t *pool) : pool(pool) {
+    }
+
+    char* allocate(size_t n) {
+        return (char*) ngx_pnalloc(this->pool, n);
+    }
+
+    ngx_pool_t *pool;
+};
+
+/*
+ * Collects what a producer writes into bufs of the request pool, a buf
+ * goes back to free once the client has taken all of it.
+ */
+struct ngx_http_hi_writer : public hi::response::writer {
+
+    ngx_http_hi_writer(ngx_http_request_t *r) : r(r) {
+    }
+
+    void write(const char* data, size_t n) {
+        while (n > 0 && !this->failed) {
+            if (this->tail == NULL || this->tail->buf->flush || this->tail->buf->last == this->tail->buf->end) {
+                this->next();
+                continue;
+            }
+            ngx_buf_t *b = this->tail->buf;
+            size_t len = ngx_min(n, (size_t) (b->end - b->last));
+            b->last = ngx_cpymem(b->last, data, len);
+            data += len;
+            n -= len;
+        }
+    }
+
+    void flush() {
+        this->mark(true);
+    }
+
+    // flags the end of the body, or of what is to be sent right away
+    void mark(bool flush) {
+        if (this->tail == NULL || this->tail->buf->last == this->tail->buf->pos) {
+            ngx_buf_t *b = (ngx_buf_t*) ngx_calloc_buf(this->r->pool);
+            ngx_chain_t *cl = ngx_alloc_chain_link(this->r->pool);
+            if (b == NULL || cl == NULL) {
+                this->failed = true;
+                return;
+            }
+            cl->buf = b;
+            this->push(cl);
+        }
+        if (flush) {
+            this->tail->buf->flush = 1;
+        } else {
+            this->tail->buf->last_buf = 1;
+        }
+    }
+
+    void next() {
+        ngx_chain_t *cl = ngx_chain_get_free_buf(this->r->pool, &this->free);
+        if (cl == NULL) {
+            this->failed = true;
+            return;
+        }
+        ngx_buf_t *b = cl->buf;
+        if (b->start == NULL) {
+            b->start = (u_char*) ngx_palloc(this->r->pool, STREAM_BUF_SIZE);
+            if (b->start == NULL) {
+                this->failed = true;
+                return;
+            }
+            b->pos = b->last = b->start;
+            b->end = b->start + STREAM_BUF_SIZE;
+            b->temporary = 1;
+            b->tag = (ngx_buf_tag_t) & ngx_http_hi_module;
+        }
+        b->flush = 0;
+        b->last_buf = 0;
+        this->push(cl);
+    }
+
+    void push(ngx_chain_t *cl) {
+        cl->next = NULL;
+        if (this->tail) {
+            this->tail->next = cl;
+        } else {
+            this->out = cl;
+        }
+        this->tail = cl;
+    }
+
+    ngx_http_request_t *r;
+    ngx_chain_t *out = NULL, *tail = NULL, *free = NULL, *busy = NULL;
+    bool failed = false, done = false;
+};
+
+/*
+ * Handed to hiredis for a read of a request, r is cleared once the request
+ * is gone or stopped waiting after hi_redis_timeout.
+ */
+struct ngx_http_hi_redis_wait_t {
+    ngx_http_request_t *r;
+};
+
+/*
+ * Lives in a cleanup of the request pool, so the response body and headers
+ * that the output chain points into stay valid until the request is freed.
+ */
+struct ngx_http_hi_ctx_t {
+
+    ngx_http_hi_ctx_t(ngx_http_request_t *r) : view(r, &req.session), alloc(r->pool), writer(r) {
+        res.pool = &alloc;
+        ngx_memzero(&sleep, sizeof (ngx_event_t));
+        ngx_memzero(&wait, sizeof (ngx_event_t));
+        ngx_memzero(&redis_timer, sizeof (ngx_event_t));
+    }
+
+    hi::request req;
+    hi::response res;
+    hi::ngx_request view;
+    ngx_http_hi_pool_allocator alloc;
+    ngx_http_hi_writer writer;
+    std::string session_id;
+    hi::redis_async* redis = 0;
+    bool session_cache = false;
+    time_t session_expires = 0;
+    // the session read or hi.redis command waited for
+    ngx_http_hi_redis_wait_t* redis_wait = 0;
+    ngx_event_t redis_timer;
+    cache::key128 cache_k;
+    // holds the hi_cache_lock of cache_k, or waits for it on wait
+    bool cache_locked = false;
+    bool cache_waiting = false;
+    bool cache_nolock = false;
+    // runs in the background only to store a new entry
+    bool cache_refresh = false;
+    ngx_event_t wait;
+    // the coroutine a lua location runs in, and its hi.sleep timer
+    std::shared_ptr<hi::lua> lua;
+    hi::lua::task* task = 0;
+    ngx_event_t sleep;
+    hi::boost_py::gil_time gil;
+};
+
+/*
+ * Waits for hi.sleep, hi.redis and hi.subrequest of a lua coroutine on the
+ * event loop, the coroutine is resumed from the event that completes them.
+ */
+struct ngx_http_hi_lua_io : public hi::lua::io {
+    bool sleep(hi::lua::task* t, long msec);
+    bool redis(hi::lua::task* t, const std::vector<std::string>& cmd);
+    bool subrequest(hi::lua::task* t, const std::string& uri, const std::string& args);
+};
+
+static ngx_http_hi_lua_io LUA_IO;
 
 enum application_t {
     cpp, python, lua, unkown
@@ -44,43 +263,121 @@ enum application_t {
 typedef struct {
     ngx_str_t module_path;
     ngx_str_t redis_host;
+    ngx_str_t redis_upstream;
     ngx_str_t python_script;
     ngx_str_t python_content;
     ngx_str_t lua_script;
     ngx_str_t lua_content;
     ngx_int_t redis_port;
+    ngx_int_t redis_index;
+    ngx_msec_t redis_timeout;
+    ngx_int_t thread_pool_index;
     ngx_int_t module_index;
     ngx_int_t cache_expires;
+    ngx_msec_t cache_lock_timeout;
+    ngx_uint_t cache_use_stale;
     ngx_int_t session_expires;
+    ngx_int_t script_cache_valid;
+    ngx_int_t script_index;
+    ngx_array_t *warmup;
     ngx_int_t cache_index;
     size_t cache_size;
+    size_t cache_max_bytes;
+    ngx_uint_t cache_policy;
+    size_t session_cache_size;
+    size_t servlet_pool_size;
     ngx_flag_t need_headers;
     ngx_flag_t need_cache;
+    // need_cache, or whether a cache is configured when it is not set
+    ngx_flag_t use_cache;
+    ngx_flag_t cache_lock;
     ngx_flag_t need_cookies;
     ngx_flag_t need_session;
+    ngx_shm_zone_t *cache_zone;
     application_t app_type;
 } ngx_http_hi_loc_conf_t;
 
+// the locations running python or lua, set up in every worker by init_process
+static std::vector<ngx_http_hi_loc_conf_t*> SCRIPT;
+
 
 static ngx_int_t clean_up(ngx_conf_t *cf);
+static ngx_int_t ngx_http_hi_preconfiguration(ngx_conf_t *cf);
+static ngx_int_t ngx_http_hi_init_process(ngx_cycle_t *cycle);
+static void ngx_http_hi_exit_process(ngx_cycle_t *cycle);
+static void ngx_http_hi_script_warmup(ngx_cycle_t *cycle, ngx_http_hi_loc_conf_t *conf);
+static ngx_int_t ngx_http_hi_cache_variable(ngx_http_request_t *r, ngx_http_variable_value_t *v, uintptr_t data);
+static ngx_int_t ngx_http_hi_gil_variable(ngx_http_request_t *r, ngx_http_variable_value_t *v, uintptr_t data);
 static char *ngx_http_hi_conf_init(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
 static void * ngx_http_hi_create_loc_conf(ngx_conf_t *cf);
 static char * ngx_http_hi_merge_loc_conf(ngx_conf_t* cf, void* parent, void* child);
+static char *ngx_http_hi_cache_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char *ngx_http_hi_redis_upstream(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+#if (NGX_THREADS)
+static char *ngx_http_hi_thread_pool(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static ngx_int_t ngx_http_hi_thread_pool_variable(ngx_http_request_t *r, ngx_http_variable_value_t *v, uintptr_t data);
+#endif
+static ngx_int_t ngx_http_hi_cache_init_zone(ngx_shm_zone_t *shm_zone, void *data);
+static void ngx_http_hi_cache_rbtree_insert_value(ngx_rbtree_node_t *temp, ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel);
+static ngx_int_t ngx_http_hi_cache_zone_get(ngx_shm_zone_t *shm_zone, u_char *key, time_t expires, time_t lease, ngx_pool_t *pool, cache_ele_t& ele);
+static void ngx_http_hi_cache_zone_put(ngx_shm_zone_t *shm_zone, u_char *key, const cache_ele_t& ele);
 
 
 static ngx_int_t ngx_http_hi_handler(ngx_http_request_t *r);
 static void ngx_http_hi_body_handler(ngx_http_request_t* r);
 static ngx_int_t ngx_http_hi_normal_handler(ngx_http_request_t *r);
-
-
-static void get_input_headers(ngx_http_request_t* r, std::unordered_map<std::string, std::string>& input_headers);
+static ngx_int_t ngx_http_hi_cache_handler(ngx_http_request_t *r, ngx_http_hi_ctx_t *ctx);
+static ngx_int_t ngx_http_hi_cache_refresh(ngx_http_request_t *r);
+static void ngx_http_hi_cache_wait_handler(ngx_event_t *ev);
+static void ngx_http_hi_cache_unlock(ngx_http_hi_ctx_t *ctx);
+static void ngx_http_hi_cache_unwait(ngx_http_request_t *r, ngx_http_hi_ctx_t *ctx);
+static ngx_int_t ngx_http_hi_start(ngx_http_request_t *r, ngx_http_hi_ctx_t *ctx);
+static ngx_int_t ngx_http_hi_run(ngx_http_request_t *r, ngx_http_hi_ctx_t *ctx);
+static ngx_int_t ngx_http_hi_finish(ngx_http_request_t *r, ngx_http_hi_ctx_t *ctx);
+#if (NGX_THREADS)
+static void ngx_http_hi_thread_handler(void *data, ngx_log_t *log);
+static void ngx_http_hi_thread_event_handler(ngx_event_t *ev);
+#endif
+static ngx_int_t ngx_http_hi_send_response(ngx_http_request_t *r, ngx_http_hi_ctx_t *ctx);
+static ngx_int_t ngx_http_hi_stream(ngx_http_request_t *r, ngx_http_hi_ctx_t *ctx);
+static ngx_int_t ngx_http_hi_stream_wait(ngx_http_request_t *r);
+static void ngx_http_hi_stream_handler(ngx_http_request_t *r);
+static void ngx_http_hi_session_handler(redisAsyncContext *ac, void *reply, void *privdata);
+static void ngx_http_hi_session_timeout_handler(ngx_event_t *ev);
+static void ngx_http_hi_redis_wait(ngx_http_request_t *r, ngx_http_hi_ctx_t *ctx, ngx_http_hi_redis_wait_t *wait, ngx_event_handler_pt handler);
+static void ngx_http_hi_redis_unwait(ngx_http_hi_ctx_t *ctx);
+static void ngx_http_hi_session_write_back(ngx_http_hi_loc_conf_t *conf, ngx_http_hi_ctx_t *ctx);
+static ngx_http_hi_ctx_t *ngx_http_hi_create_ctx(ngx_http_request_t *r);
+static void ngx_http_hi_ctx_cleanup(void *data);
+
+
+static void ngx_http_hi_fill_request(ngx_http_hi_loc_conf_t *conf, ngx_http_hi_ctx_t *ctx);
 static void set_output_headers(ngx_http_request_t* r, std::unordered_multimap<std::string, std::string>& output_headers);
-static ngx_str_t get_input_body(ngx_http_request_t *r);
 
-static void ngx_http_hi_cpp_handler(ngx_http_hi_loc_conf_t * conf, hi::request& req, hi::response& res);
-static void ngx_http_hi_python_handler(ngx_http_hi_loc_conf_t * conf, hi::request& req, hi::response& res);
+static void ngx_http_hi_cpp_handler(ngx_http_hi_loc_conf_t * conf, ngx_http_hi_ctx_t *ctx);
+static void ngx_http_hi_python_handler(ngx_http_hi_loc_conf_t * conf, hi::request& req, hi::request_view* view, hi::response& res, hi::boost_py::gil_time* time);
 static void ngx_http_hi_lua_handler(ngx_http_hi_loc_conf_t * conf, hi::request& req, hi::response& res);
+static hi::lua::status_t ngx_http_hi_lua_start(ngx_http_hi_loc_conf_t * conf, ngx_http_request_t *r, ngx_http_hi_ctx_t *ctx);
+static void ngx_http_hi_lua_resume(ngx_http_request_t *r, ngx_http_hi_ctx_t *ctx, int nargs);
+static void ngx_http_hi_lua_sleep_handler(ngx_event_t *ev);
+static void ngx_http_hi_lua_redis_handler(redisAsyncContext *ac, void *reply, void *privdata);
+static void ngx_http_hi_lua_redis_timeout_handler(ngx_event_t *ev);
+static int ngx_http_hi_lua_push_reply(lua_State *L, redisReply *rep);
+static ngx_int_t ngx_http_hi_lua_subrequest_done(ngx_http_request_t *sr, void *data, ngx_int_t rc);
+static void ngx_http_hi_lua_subrequest_handler(ngx_http_request_t *r);
+static void ngx_http_hi_lua_subrequest_cleanup(void *data);
+
+static ngx_conf_enum_t ngx_http_hi_cache_use_stale[] = {
+    { ngx_string("off"), 0},
+    { ngx_string("updating"), 1},
+    { ngx_null_string, 0}
+};
 
+static ngx_conf_enum_t ngx_http_hi_cache_policy[] = {
+    { ngx_string("lru"), cache::lru},
+    { ngx_string("tinylfu"), cache::tinylfu},
+    { ngx_null_string, 0}
+};
 
 ngx_command_t ngx_http_hi_commands[] = {
     {
@@ -91,6 +388,14 @@ ngx_command_t ngx_http_hi_commands[] = {
         offsetof(ngx_http_hi_loc_conf_t, module_path),
         NULL
     },
+    {
+        ngx_string("hi_servlet_pool_size"),
+        NGX_HTTP_LOC_CONF | NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_SIF_CONF | NGX_HTTP_LIF_CONF | NGX_CONF_TAKE1,
+        ngx_conf_set_num_slot,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        offsetof(ngx_http_hi_loc_conf_t, servlet_pool_size),
+        NULL
+    },
     {
         ngx_string("hi_cache_size"),
         NGX_HTTP_LOC_CONF | NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_SIF_CONF | NGX_HTTP_LIF_CONF | NGX_CONF_TAKE1,
@@ -99,6 +404,30 @@ ngx_command_t ngx_http_hi_commands[] = {
         offsetof(ngx_http_hi_loc_conf_t, cache_size),
         NULL
     },
+    {
+        ngx_string("hi_cache_max_bytes"),
+        NGX_HTTP_LOC_CONF | NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_SIF_CONF | NGX_HTTP_LIF_CONF | NGX_CONF_TAKE1,
+        ngx_conf_set_size_slot,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        offsetof(ngx_http_hi_loc_conf_t, cache_max_bytes),
+        NULL
+    },
+    {
+        ngx_string("hi_cache_policy"),
+        NGX_HTTP_LOC_CONF | NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_SIF_CONF | NGX_HTTP_LIF_CONF | NGX_CONF_TAKE1,
+        ngx_conf_set_enum_slot,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        offsetof(ngx_http_hi_loc_conf_t, cache_policy),
+        &ngx_http_hi_cache_policy
+    },
+    {
+        ngx_string("hi_cache_zone"),
+        NGX_HTTP_LOC_CONF | NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_SIF_CONF | NGX_HTTP_LIF_CONF | NGX_CONF_TAKE1,
+        ngx_http_hi_cache_zone,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        0,
+        NULL
+    },
     {
         ngx_string("hi_cache_expires"),
         NGX_HTTP_LOC_CONF | NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_SIF_CONF | NGX_HTTP_LIF_CONF | NGX_CONF_TAKE1,
@@ -107,6 +436,40 @@ ngx_command_t ngx_http_hi_commands[] = {
         offsetof(ngx_http_hi_loc_conf_t, cache_expires),
         NULL
     },
+    {
+        ngx_string("hi_cache_lock"),
+        NGX_HTTP_LOC_CONF | NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_SIF_CONF | NGX_HTTP_LIF_CONF | NGX_CONF_TAKE1,
+        ngx_conf_set_flag_slot,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        offsetof(ngx_http_hi_loc_conf_t, cache_lock),
+        NULL
+    },
+    {
+        ngx_string("hi_cache_lock_timeout"),
+        NGX_HTTP_LOC_CONF | NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_SIF_CONF | NGX_HTTP_LIF_CONF | NGX_CONF_TAKE1,
+        ngx_conf_set_msec_slot,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        offsetof(ngx_http_hi_loc_conf_t, cache_lock_timeout),
+        NULL
+    },
+    {
+        ngx_string("hi_cache_use_stale"),
+        NGX_HTTP_LOC_CONF | NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_SIF_CONF | NGX_HTTP_LIF_CONF | NGX_CONF_TAKE1,
+        ngx_conf_set_enum_slot,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        offsetof(ngx_http_hi_loc_conf_t, cache_use_stale),
+        &ngx_http_hi_cache_use_stale
+    },
+#if (NGX_THREADS)
+    {
+        ngx_string("hi_thread_pool"),
+        NGX_HTTP_LOC_CONF | NGX_HTTP_LIF_CONF | NGX_CONF_TAKE1,
+        ngx_http_hi_thread_pool,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        0,
+        NULL
+    },
+#endif
     {
         ngx_string("hi_need_headers"),
         NGX_HTTP_LOC_CONF | NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_SIF_CONF | NGX_HTTP_LIF_CONF | NGX_CONF_TAKE1,
@@ -147,6 +510,30 @@ ngx_command_t ngx_http_hi_commands[] = {
         offsetof(ngx_http_hi_loc_conf_t, redis_port),
         NULL
     },
+    {
+        ngx_string("hi_redis_timeout"),
+        NGX_HTTP_LOC_CONF | NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_SIF_CONF | NGX_HTTP_LIF_CONF | NGX_CONF_TAKE1,
+        ngx_conf_set_msec_slot,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        offsetof(ngx_http_hi_loc_conf_t, redis_timeout),
+        NULL
+    },
+    {
+        ngx_string("hi_redis_upstream"),
+        NGX_HTTP_MAIN_CONF | NGX_CONF_2MORE,
+        ngx_http_hi_redis_upstream,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        0,
+        NULL
+    },
+    {
+        ngx_string("hi_redis_pass"),
+        NGX_HTTP_LOC_CONF | NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_SIF_CONF | NGX_HTTP_LIF_CONF | NGX_CONF_TAKE1,
+        ngx_conf_set_str_slot,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        offsetof(ngx_http_hi_loc_conf_t, redis_upstream),
+        NULL
+    },
     {
         ngx_string("hi_need_session"),
         NGX_HTTP_LOC_CONF | NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_SIF_CONF | NGX_HTTP_LIF_CONF | NGX_CONF_TAKE1,
@@ -163,6 +550,30 @@ ngx_command_t ngx_http_hi_commands[] = {
         offsetof(ngx_http_hi_loc_conf_t, session_expires),
         NULL
     },
+    {
+        ngx_string("hi_session_cache_size"),
+        NGX_HTTP_LOC_CONF | NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_SIF_CONF | NGX_HTTP_LIF_CONF | NGX_CONF_TAKE1,
+        ngx_conf_set_num_slot,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        offsetof(ngx_http_hi_loc_conf_t, session_cache_size),
+        NULL
+    },
+    {
+        ngx_string("hi_script_cache_valid"),
+        NGX_HTTP_LOC_CONF | NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_SIF_CONF | NGX_HTTP_LIF_CONF | NGX_CONF_TAKE1,
+        ngx_conf_set_sec_slot,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        offsetof(ngx_http_hi_loc_conf_t, script_cache_valid),
+        NULL
+    },
+    {
+        ngx_string("hi_warmup"),
+        NGX_HTTP_LOC_CONF | NGX_HTTP_LIF_CONF | NGX_CONF_TAKE1,
+        ngx_conf_set_str_array_slot,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        offsetof(ngx_http_hi_loc_conf_t, warmup),
+        NULL
+    },
     {
         ngx_string("hi_python_script"),
         NGX_HTTP_LOC_CONF | NGX_HTTP_LIF_CONF | NGX_CONF_TAKE1,
@@ -199,8 +610,22 @@ ngx_command_t ngx_http_hi_commands[] = {
 };
 
 
+static ngx_http_variable_t ngx_http_hi_vars[] = {
+    { ngx_string("hi_cache_bytes"), NULL, ngx_http_hi_cache_variable, 0, NGX_HTTP_VAR_NOCACHEABLE, 0},
+    { ngx_string("hi_cache_entries"), NULL, ngx_http_hi_cache_variable, 1, NGX_HTTP_VAR_NOCACHEABLE, 0},
+    { ngx_string("hi_cache_evictions"), NULL, ngx_http_hi_cache_variable, 2, NGX_HTTP_VAR_NOCACHEABLE, 0},
+    { ngx_string("hi_python_gil_wait"), NULL, ngx_http_hi_gil_variable, 0, NGX_HTTP_VAR_NOCACHEABLE, 0},
+    { ngx_string("hi_python_gil_time"), NULL, ngx_http_hi_gil_variable, 1, NGX_HTTP_VAR_NOCACHEABLE, 0},
+#if (NGX_THREADS)
+    { ngx_string("hi_thread_pool_queue"), NULL, ngx_http_hi_thread_pool_variable, 0, NGX_HTTP_VAR_NOCACHEABLE, 0},
+    { ngx_string("hi_thread_pool_rejected"), NULL, ngx_http_hi_thread_pool_variable, 1, NGX_HTTP_VAR_NOCACHEABLE, 0},
+#endif
+    { ngx_null_string, NULL, NULL, 0, 0, 0}
+};
+
+
 ngx_http_module_t ngx_http_hi_module_ctx = {
-    clean_up, /* preconfiguration */
+    ngx_http_hi_preconfiguration, /* preconfiguration */
     NULL, /* postconfiguration */
     NULL, /* create main configuration */
     NULL, /* init main configuration */
@@ -222,10 +647,10 @@ ngx_module_t ngx_http_hi_module = {
     NGX_HTTP_MODULE, /* module type */
     NULL, /* init master */
     NULL, /* init module */
-    NULL, /* init process */
+    ngx_http_hi_init_process, /* init process */
     NULL, /* init thread */
     NULL, /* exit thread */
-    NULL, /* exit process */
+    ngx_http_hi_exit_process, /* exit process */
     NULL, /* exit master */
     NGX_MODULE_V1_PADDING
 };
@@ -233,9 +658,210 @@ ngx_module_t ngx_http_hi_module = {
 static ngx_int_t clean_up(ngx_conf_t *cf) {
     PLUGIN.clear();
     CACHE.clear();
+    REDIS.clear();
+    SESSION.clear();
+    PYTHON.clear();
+    LUA.clear();
+    SCRIPT.clear();
+#if (NGX_THREADS)
+    THREAD_POOL.clear();
+#endif
+    return NGX_OK;
+}
+
+static ngx_int_t ngx_http_hi_init_process(ngx_cycle_t *cycle) {
+    hi::worker_ctx ctx;
+    ctx.worker = (int) ngx_worker;
+    ctx.pid = (int) ngx_pid;
+    for (auto& item : PLUGIN) {
+        ctx.module = item->get_module();
+        if (!item->init(ctx)) {
+            ngx_log_error(NGX_LOG_EMERG, cycle->log, 0, "hi_init() of %s failed", ctx.module.c_str());
+            return NGX_ERROR;
+        }
+    }
+    for (auto conf : SCRIPT) {
+        ngx_http_hi_script_warmup(cycle, conf);
+    }
+    return NGX_OK;
+}
+
+/*
+ * Sets up the interpreter of a location before the first request, loads
+ * its inline code and runs its script for every hi_warmup uri as a GET.
+ */
+static void ngx_http_hi_script_warmup(ngx_cycle_t *cycle, ngx_http_hi_loc_conf_t *conf) {
+    try {
+        if (conf->app_type == python) {
+            hi::boost_py::gil lock;
+            PYTHON[conf->script_index].push_back(std::make_shared<hi::boost_py>());
+            if (conf->python_content.len > 0) {
+                PYTHON[conf->script_index].back()->load_content((char*) conf->python_content.data);
+            }
+        } else {
+            LUA[conf->script_index] = std::make_shared<hi::lua>();
+            LUA[conf->script_index]->set_io(&LUA_IO);
+            if (conf->lua_content.len > 0) {
+                LUA[conf->script_index]->load_content((char*) conf->lua_content.data);
+            }
+        }
+    } catch (const boost::python::error_already_set&) {
+        PyErr_Clear();
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, 0, "Failed to set up python.");
+        return;
+    }
+    if (conf->warmup == NULL) {
+        return;
+    }
+    ngx_str_t *uri = (ngx_str_t*) conf->warmup->elts;
+    for (ngx_uint_t i = 0; i < conf->warmup->nelts; ++i) {
+        hi::request req;
+        hi::response res;
+        req.method = "GET";
+        req.client = "127.0.0.1";
+        req.uri.assign((char*) uri[i].data, uri[i].len);
+        if (conf->app_type == python) {
+            ngx_http_hi_python_handler(conf, req, NULL, res, NULL);
+        } else {
+            ngx_http_hi_lua_handler(conf, req, res);
+        }
+        if (res.status >= 500) {
+            ngx_log_error(NGX_LOG_WARN, cycle->log, 0, "Warm-up of %V failed with %d.", &uri[i], res.status);
+        }
+    }
+}
+
+static void ngx_http_hi_exit_process(ngx_cycle_t *cycle) {
+    for (auto& item : PLUGIN) {
+        item->fini();
+    }
+    if (Py_IsInitialized()) {
+        hi::boost_py::gil lock;
+        PYTHON.clear();
+    }
+    LUA.clear();
+}
+
+static ngx_int_t ngx_http_hi_preconfiguration(ngx_conf_t *cf) {
+    ngx_http_variable_t *var, *v;
+
+    for (v = ngx_http_hi_vars; v->name.len; v++) {
+        var = ngx_http_add_variable(cf, &v->name, v->flags);
+        if (var == NULL) {
+            return NGX_ERROR;
+        }
+        var->get_handler = v->get_handler;
+        var->data = v->data;
+    }
+    return clean_up(cf);
+}
+
+static ngx_int_t ngx_http_hi_cache_variable(ngx_http_request_t *r, ngx_http_variable_value_t *v, uintptr_t data) {
+    ngx_http_hi_loc_conf_t * conf = (ngx_http_hi_loc_conf_t *) ngx_http_get_module_loc_conf(r, ngx_http_hi_module);
+    size_t value[3];
+    u_char *p;
+
+    if (conf->use_cache != 1) {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+    if (conf->cache_zone) {
+        ngx_http_hi_cache_zone_ctx_t *ctx = (ngx_http_hi_cache_zone_ctx_t*) conf->cache_zone->data;
+        ngx_shmtx_lock(&ctx->shpool->mutex);
+        value[0] = ctx->sh->bytes;
+        value[1] = ctx->sh->entries;
+        value[2] = ctx->sh->evictions;
+        ngx_shmtx_unlock(&ctx->shpool->mutex);
+    } else {
+        value[0] = CACHE[conf->cache_index]->bytes();
+        value[1] = CACHE[conf->cache_index]->size();
+        value[2] = CACHE[conf->cache_index]->evictions();
+    }
+
+    p = (u_char*) ngx_pnalloc(r->pool, NGX_SIZE_T_LEN);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+    v->len = ngx_sprintf(p, "%uz", value[data]) - p;
+    v->valid = 1;
+    v->no_cacheable = 1;
+    v->not_found = 0;
+    v->data = p;
+    return NGX_OK;
+}
+
+// microseconds the request waited for the GIL and held it
+static ngx_int_t ngx_http_hi_gil_variable(ngx_http_request_t *r, ngx_http_variable_value_t *v, uintptr_t data) {
+    ngx_http_hi_loc_conf_t * conf = (ngx_http_hi_loc_conf_t *) ngx_http_get_module_loc_conf(r, ngx_http_hi_module);
+    ngx_http_hi_ctx_t *ctx = (ngx_http_hi_ctx_t*) ngx_http_get_module_ctx(r, ngx_http_hi_module);
+    u_char *p;
+
+    if (conf->app_type != python || ctx == NULL) {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    p = (u_char*) ngx_pnalloc(r->pool, NGX_INT64_LEN);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+    v->len = ngx_sprintf(p, "%L", (int64_t) (data == 0 ? ctx->gil.wait : ctx->gil.held)) - p;
+    v->valid = 1;
+    v->no_cacheable = 1;
+    v->not_found = 0;
+    v->data = p;
+    return NGX_OK;
+}
+
+#if (NGX_THREADS)
+
+static ngx_int_t ngx_http_hi_thread_pool_variable(ngx_http_request_t *r, ngx_http_variable_value_t *v, uintptr_t data) {
+    ngx_http_hi_loc_conf_t * conf = (ngx_http_hi_loc_conf_t *) ngx_http_get_module_loc_conf(r, ngx_http_hi_module);
+    u_char *p;
+
+    if (conf->thread_pool_index == NGX_CONF_UNSET) {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+    ngx_http_hi_thread_pool_t& tp = THREAD_POOL[conf->thread_pool_index];
+
+    p = (u_char*) ngx_pnalloc(r->pool, NGX_INT_T_LEN);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+    v->len = ngx_sprintf(p, "%ui", data == 0 ? tp.queued : tp.rejected) - p;
+    v->valid = 1;
+    v->no_cacheable = 1;
+    v->not_found = 0;
+    v->data = p;
     return NGX_OK;
 }
 
+static char *ngx_http_hi_thread_pool(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+    ngx_http_hi_loc_conf_t *hlcf = (ngx_http_hi_loc_conf_t*) conf;
+    ngx_str_t *value = (ngx_str_t*) cf->args->elts;
+    ngx_thread_pool_t *pool;
+
+    if (hlcf->thread_pool_index != NGX_CONF_UNSET) {
+        return (char*) "is duplicate";
+    }
+    pool = ngx_thread_pool_add(cf, &value[1]);
+    if (pool == NULL) {
+        return (char*) NGX_CONF_ERROR;
+    }
+    for (size_t i = 0; i < THREAD_POOL.size(); ++i) {
+        if (THREAD_POOL[i].pool == pool) {
+            hlcf->thread_pool_index = i;
+            return NGX_CONF_OK;
+        }
+    }
+    ngx_http_hi_thread_pool_t tp = {pool, 0, 0};
+    THREAD_POOL.push_back(tp);
+    hlcf->thread_pool_index = THREAD_POOL.size() - 1;
+    return NGX_CONF_OK;
+}
+#endif
+
 static char *ngx_http_hi_conf_init(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
     ngx_http_core_loc_conf_t *clcf;
     clcf = (ngx_http_core_loc_conf_t *) ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
@@ -252,6 +878,8 @@ static void * ngx_http_hi_create_loc_conf(ngx_conf_t *cf) {
         conf->module_index = NGX_CONF_UNSET;
         conf->redis_host.len = 0;
         conf->redis_host.data = NULL;
+        conf->redis_upstream.len = 0;
+        conf->redis_upstream.data = NULL;
         conf->python_script.len = 0;
         conf->python_script.data = NULL;
         conf->python_content.len = 0;
@@ -261,14 +889,28 @@ static void * ngx_http_hi_create_loc_conf(ngx_conf_t *cf) {
         conf->lua_content.len = 0;
         conf->lua_content.data = NULL;
         conf->redis_port = NGX_CONF_UNSET;
+        conf->redis_timeout = NGX_CONF_UNSET_MSEC;
+        conf->redis_index = NGX_CONF_UNSET;
+        conf->thread_pool_index = NGX_CONF_UNSET;
         conf->cache_size = NGX_CONF_UNSET_UINT;
+        conf->session_cache_size = NGX_CONF_UNSET_UINT;
+        conf->servlet_pool_size = NGX_CONF_UNSET_UINT;
+        conf->cache_max_bytes = NGX_CONF_UNSET_SIZE;
+        conf->cache_policy = NGX_CONF_UNSET_UINT;
         conf->cache_expires = NGX_CONF_UNSET;
+        conf->cache_lock_timeout = NGX_CONF_UNSET_MSEC;
+        conf->cache_use_stale = NGX_CONF_UNSET_UINT;
         conf->session_expires = NGX_CONF_UNSET;
+        conf->script_cache_valid = NGX_CONF_UNSET;
+        conf->script_index = NGX_CONF_UNSET;
+        conf->warmup = (ngx_array_t*) NGX_CONF_UNSET_PTR;
         conf->cache_index = NGX_CONF_UNSET;
         conf->need_headers = NGX_CONF_UNSET;
         conf->need_cache = NGX_CONF_UNSET;
+        conf->cache_lock = NGX_CONF_UNSET;
         conf->need_cookies = NGX_CONF_UNSET;
         conf->need_session = NGX_CONF_UNSET;
+        conf->cache_zone = (ngx_shm_zone_t*) NGX_CONF_UNSET_PTR;
         conf->app_type = unkown;
         return conf;
     }
@@ -281,21 +923,85 @@ static char * ngx_http_hi_merge_loc_conf(ngx_conf_t* cf, void* parent, void* chi
 
     ngx_conf_merge_str_value(conf->module_path, prev->module_path, "");
     ngx_conf_merge_str_value(conf->redis_host, prev->redis_host, "");
+    ngx_conf_merge_str_value(conf->redis_upstream, prev->redis_upstream, "");
     ngx_conf_merge_str_value(conf->python_script, prev->python_script, "");
     ngx_conf_merge_str_value(conf->python_content, prev->python_content, "");
     ngx_conf_merge_str_value(conf->lua_script, prev->lua_script, "");
     ngx_conf_merge_str_value(conf->lua_content, prev->lua_content, "");
     ngx_conf_merge_value(conf->redis_port, prev->redis_port, (ngx_int_t) 0);
+    ngx_conf_merge_msec_value(conf->redis_timeout, prev->redis_timeout, (ngx_msec_t) 3000);
     ngx_conf_merge_uint_value(conf->cache_size, prev->cache_size, (size_t) 10);
+    ngx_conf_merge_size_value(conf->cache_max_bytes, prev->cache_max_bytes, (size_t) 0);
+    ngx_conf_merge_uint_value(conf->cache_policy, prev->cache_policy, (ngx_uint_t) cache::lru);
+    ngx_conf_merge_uint_value(conf->session_cache_size, prev->session_cache_size, (size_t) 0);
+    ngx_conf_merge_value(conf->thread_pool_index, prev->thread_pool_index, NGX_CONF_UNSET);
+    ngx_conf_merge_uint_value(conf->servlet_pool_size, prev->servlet_pool_size, (size_t) 0);
     ngx_conf_merge_sec_value(conf->cache_expires, prev->cache_expires, (ngx_int_t) 300);
+    ngx_conf_merge_msec_value(conf->cache_lock_timeout, prev->cache_lock_timeout, (ngx_msec_t) 5000);
+    ngx_conf_merge_uint_value(conf->cache_use_stale, prev->cache_use_stale, (ngx_uint_t) 0);
     ngx_conf_merge_sec_value(conf->session_expires, prev->session_expires, (ngx_int_t) 300);
+    ngx_conf_merge_sec_value(conf->script_cache_valid, prev->script_cache_valid, (ngx_int_t) 0);
     ngx_conf_merge_value(conf->need_headers, prev->need_headers, (ngx_flag_t) 0);
-    ngx_conf_merge_value(conf->need_cache, prev->need_cache, (ngx_flag_t) 1);
+    ngx_conf_merge_value(conf->need_cache, prev->need_cache, NGX_CONF_UNSET);
+    ngx_conf_merge_value(conf->cache_lock, prev->cache_lock, (ngx_flag_t) 0);
     ngx_conf_merge_value(conf->need_cookies, prev->need_cookies, (ngx_flag_t) 0);
     ngx_conf_merge_value(conf->need_session, prev->need_session, (ngx_flag_t) 0);
+    ngx_conf_merge_ptr_value(conf->cache_zone, prev->cache_zone, NULL);
+    ngx_conf_merge_ptr_value(conf->warmup, prev->warmup, NULL);
+    // need_cache stays unset, a location may still size a cache of its own
+    if (conf->need_cache != NGX_CONF_UNSET) {
+        conf->use_cache = conf->need_cache;
+    } else {
+        conf->use_cache = conf->cache_size > 0 || conf->cache_max_bytes > 0 || conf->cache_zone != NULL;
+    }
     if (conf->need_session == 1 && conf->need_cookies == 0) {
         conf->need_cookies = 1;
     }
+    // lua locations reach redis through hi.redis
+    if ((conf->need_session == 1 || conf->lua_content.len > 0 || conf->lua_script.len > 0) && conf->redis_index == NGX_CONF_UNSET) {
+        std::string name;
+        if (conf->redis_upstream.len > 0) {
+            name.assign((char*) conf->redis_upstream.data, conf->redis_upstream.len);
+        } else if (conf->redis_host.len > 0 && conf->redis_port > 0) {
+            name.assign((char*) conf->redis_host.data, conf->redis_host.len).append(":").append(std::to_string(conf->redis_port));
+        }
+        if (!name.empty()) {
+            for (size_t i = 0; i < REDIS.size(); ++i) {
+                if (REDIS[i]->get_name() == name) {
+                    conf->redis_index = i;
+                    break;
+                }
+            }
+            if (conf->redis_index == NGX_CONF_UNSET) {
+                if (conf->redis_upstream.len > 0) {
+                    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "unknown hi_redis_upstream \"%V\"", &conf->redis_upstream);
+                    return (char*) NGX_CONF_ERROR;
+                }
+                REDIS.push_back(std::make_shared<hi::redis_pool>(name));
+                REDIS.back()->add_server(std::string((char*) conf->redis_host.data, conf->redis_host.len), (int) conf->redis_port);
+                conf->redis_index = REDIS.size() - 1;
+            }
+        }
+    }
+    if (conf->need_session == 1 && conf->redis_index != NGX_CONF_UNSET && conf->session_cache_size > 0) {
+        size_t index = conf->redis_index;
+        if (SESSION.size() < REDIS.size()) {
+            SESSION.resize(REDIS.size());
+        }
+        if (!SESSION[index]) {
+            REDIS[index]->watch([index](const std::string * key) {
+                if (key) {
+                    SESSION[index]->erase(*key);
+                } else {
+                    SESSION[index]->clear();
+                }
+            });
+        }
+        // still empty at this point, so the largest size asked for wins
+        if (!SESSION[index] || SESSION[index]->max_size() < conf->session_cache_size) {
+            SESSION[index] = std::make_shared<session_cache_t>(conf->session_cache_size);
+        }
+    }
     if (conf->module_index == NGX_CONF_UNSET && conf->module_path.len > 0) {
         std::string tmp((char*) conf->module_path.data, conf->module_path.len);
         if (tmp.front() != '/') {
@@ -316,9 +1022,16 @@ static char * ngx_http_hi_merge_loc_conf(ngx_conf_t* cf, void* parent, void* chi
         } else {
             PLUGIN.push_back(std::make_shared<hi::module_class < hi::servlet >> (tmp));
             conf->module_index = PLUGIN.size() - 1;
+            if (!PLUGIN.back()->is_ready()) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "can not load %s: %s", tmp.c_str(), PLUGIN.back()->get_error().c_str());
+                return (char*) NGX_CONF_ERROR;
+            }
         }
         conf->app_type = cpp;
     }
+    if (conf->app_type == cpp && conf->servlet_pool_size > PLUGIN[conf->module_index]->get_pool_size()) {
+        PLUGIN[conf->module_index]->set_pool_size(conf->servlet_pool_size);
+    }
 
     if (conf->python_content.len > 0 || conf->python_script.len > 0) {
         conf->app_type = python;
@@ -326,9 +1039,18 @@ static char * ngx_http_hi_merge_loc_conf(ngx_conf_t* cf, void* parent, void* chi
     if (conf->lua_content.len > 0 || conf->lua_script.len > 0) {
         conf->app_type = lua;
     }
+    if (conf->app_type == python) {
+        PYTHON.push_back(std::vector<std::shared_ptr<hi::boost_py>>());
+        conf->script_index = PYTHON.size() - 1;
+        SCRIPT.push_back(conf);
+    } else if (conf->app_type == lua) {
+        LUA.push_back(nullptr);
+        conf->script_index = LUA.size() - 1;
+        SCRIPT.push_back(conf);
+    }
 
-    if (conf->need_cache == 1 && conf->cache_index == NGX_CONF_UNSET) {
-        CACHE.push_back(std::make_shared<cache::lru_cache < std::string, cache_ele_t >> (conf->cache_size));
+    if (conf->use_cache == 1 && conf->cache_zone == NULL && conf->cache_index == NGX_CONF_UNSET) {
+        CACHE.push_back(std::make_shared<cache_t>(conf->cache_size, conf->cache_max_bytes, (cache::policy_t) conf->cache_policy));
         conf->cache_index = CACHE.size() - 1;
     }
 
@@ -336,204 +1058,998 @@ static char * ngx_http_hi_merge_loc_conf(ngx_conf_t* cf, void* parent, void* chi
     return NGX_CONF_OK;
 }
 
-static ngx_int_t ngx_http_hi_handler(ngx_http_request_t *r) {
-    if (r->headers_in.content_length_n > 0) {
-        if (r->headers_in.content_type->value.len < form_urlencoded_type_len
-                || ngx_strncasecmp(r->headers_in.content_type->value.data, (u_char *) form_urlencoded_type,
-                form_urlencoded_type_len) != 0) {
-            return NGX_DECLINED;
-        }
-        r->request_body_in_single_buf = 1;
-        r->request_body_file_log_level = 0;
-        ngx_int_t rc = ngx_http_read_client_request_body(r, ngx_http_hi_body_handler);
-        if (rc >= NGX_HTTP_SPECIAL_RESPONSE) {
-            return rc;
-        }
-        return NGX_DONE;
-    } else {
-        ngx_http_discard_request_body(r);
-        return ngx_http_hi_normal_handler(r);
-    }
-}
-
-static ngx_int_t ngx_http_hi_normal_handler(ngx_http_request_t *r) {
+static char *ngx_http_hi_cache_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+    ngx_http_hi_loc_conf_t * hlcf = (ngx_http_hi_loc_conf_t*) conf;
+    ngx_str_t *value, name, s;
+    ssize_t size = 0;
+    u_char *p;
+    ngx_shm_zone_t *shm_zone;
+    ngx_http_hi_cache_zone_ctx_t *ctx;
 
-    ngx_http_hi_loc_conf_t * conf = (ngx_http_hi_loc_conf_t *) ngx_http_get_module_loc_conf(r, ngx_http_hi_module);
+    if (hlcf->cache_zone != NGX_CONF_UNSET_PTR) {
+        return (char*) "is duplicate";
+    }
 
-    if (r->headers_in.if_modified_since && r->headers_in.if_modified_since->value.data) {
-        time_t now = time(NULL), old = ngx_http_parse_time(r->headers_in.if_modified_since->value.data, r->headers_in.if_modified_since->value.len);
-        if (difftime(now, old) <= conf->cache_expires) {
-            return NGX_HTTP_NOT_MODIFIED;
+    value = (ngx_str_t*) cf->args->elts;
+    name = value[1];
+    p = (u_char*) ngx_strlchr(value[1].data, value[1].data + value[1].len, ':');
+    if (p) {
+        name.len = p - value[1].data;
+        s.data = p + 1;
+        s.len = value[1].data + value[1].len - s.data;
+        size = ngx_parse_size(&s);
+        if (size == NGX_ERROR) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid zone size \"%V\"", &value[1]);
+            return (char*) NGX_CONF_ERROR;
+        }
+        if (size < (ssize_t) (8 * ngx_pagesize)) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "zone \"%V\" is too small", &value[1]);
+            return (char*) NGX_CONF_ERROR;
         }
     }
+    if (name.len == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid zone name \"%V\"", &value[1]);
+        return (char*) NGX_CONF_ERROR;
+    }
 
-    hi::request ngx_request;
-    hi::response ngx_response;
-    std::string SESSION_ID_VALUE;
-
-    ngx_request.uri.assign((char*) r->uri.data, r->uri.len);
-    if (r->args.len > 0) {
-        ngx_request.param.assign((char*) r->args.data, r->args.len);
+    shm_zone = ngx_shared_memory_add(cf, &name, size, &ngx_http_hi_module);
+    if (shm_zone == NULL) {
+        return (char*) NGX_CONF_ERROR;
     }
-    std::shared_ptr<std::string> cache_k;
-    if (conf->need_cache == 1) {
-        ngx_response.headers.insert(std::make_pair("Last-Modified", (char*) ngx_cached_http_time.data));
-        cache_k = std::make_shared<std::string>(ngx_request.uri);
-        if (r->args.len > 0) {
-            cache_k->append("?").append(ngx_request.param);
+    if (shm_zone->data == NULL) {
+        ctx = (ngx_http_hi_cache_zone_ctx_t*) ngx_pcalloc(cf->pool, sizeof (ngx_http_hi_cache_zone_ctx_t));
+        if (ctx == NULL) {
+            return (char*) NGX_CONF_ERROR;
         }
-        u_char *p;
-        ngx_md5_t md5;
-        u_char md5_buf[16];
+        shm_zone->init = ngx_http_hi_cache_init_zone;
+        shm_zone->data = ctx;
+    }
+    hlcf->cache_zone = shm_zone;
+    return NGX_CONF_OK;
+}
 
-        p = (u_char*) ngx_palloc(r->pool, 32);
-        if (p == NULL) {
-            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+static char *ngx_http_hi_redis_upstream(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+    ngx_str_t *value = (ngx_str_t*) cf->args->elts, s;
+    ngx_uint_t i;
+    std::string name((char*) value[1].data, value[1].len);
+    std::vector<std::pair<std::string, int>> servers;
+    size_t pool_size = 1;
+    time_t fail_timeout = 10;
+
+    for (auto& item : REDIS) {
+        if (item->get_name() == name) {
+            return (char*) "is duplicate";
         }
-
-        ngx_md5_init(&md5);
-        ngx_md5_update(&md5, (u_char*) cache_k->c_str(), cache_k->size());
-        ngx_md5_final(md5_buf, &md5);
-        ngx_hex_dump(p, md5_buf, sizeof (md5_buf));
-
-        cache_k->assign((char*) p, 32);
-
-        if (CACHE[conf->cache_index]->exists(*cache_k)) {
-            const cache_ele_t& cache_v = CACHE[conf->cache_index]->get(*cache_k);
-            time_t now = time(NULL);
-            if (difftime(now, cache_v.t) > conf->cache_expires) {
-                CACHE[conf->cache_index]->erase(*cache_k);
-            } else {
-                ngx_response.content = cache_v.content;
-                ngx_response.headers.find("Content-Type")->second = cache_v.header;
-                ngx_response.status = cache_v.status;
-                goto done;
+    }
+    for (i = 2; i < cf->args->nelts; ++i) {
+        if (ngx_strncmp(value[i].data, "pool=", 5) == 0) {
+            ngx_int_t n = ngx_atoi(value[i].data + 5, value[i].len - 5);
+            if (n == NGX_ERROR || n == 0) {
+                goto invalid;
             }
+            pool_size = n;
+            continue;
         }
-    }
-    if (conf->need_headers == 1) {
-        get_input_headers(r, ngx_request.headers);
+        if (ngx_strncmp(value[i].data, "fail_timeout=", 13) == 0) {
+            s.data = value[i].data + 13;
+            s.len = value[i].len - 13;
+            fail_timeout = ngx_parse_time(&s, 1);
+            if (fail_timeout == (time_t) NGX_ERROR) {
+                goto invalid;
+            }
+            continue;
+        }
+        u_char *p = (u_char*) ngx_strlchr(value[i].data, value[i].data + value[i].len, ':');
+        int port = 6379;
+        if (p) {
+            port = ngx_atoi(p + 1, value[i].data + value[i].len - p - 1);
+            if (port < 1 || port > 65535) {
+                goto invalid;
+            }
+        }
+        servers.push_back(std::make_pair(std::string((char*) value[i].data, p ? p - value[i].data : value[i].len), port));
+    }
+    if (servers.empty()) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "no servers in hi_redis_upstream \"%V\"", &value[1]);
+        return (char*) NGX_CONF_ERROR;
+    }
+
+    REDIS.push_back(std::make_shared<hi::redis_pool>(name, pool_size, fail_timeout));
+    for (auto& item : servers) {
+        REDIS.back()->add_server(item.first, item.second);
+    }
+    return NGX_CONF_OK;
+
+invalid:
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid parameter \"%V\"", &value[i]);
+    return (char*) NGX_CONF_ERROR;
+}
+
+static ngx_int_t ngx_http_hi_cache_init_zone(ngx_shm_zone_t *shm_zone, void *data) {
+    ngx_http_hi_cache_zone_ctx_t *octx = (ngx_http_hi_cache_zone_ctx_t*) data;
+    ngx_http_hi_cache_zone_ctx_t *ctx = (ngx_http_hi_cache_zone_ctx_t*) shm_zone->data;
+    size_t len;
+
+    if (octx) {
+        ctx->sh = octx->sh;
+        ctx->shpool = octx->shpool;
+        return NGX_OK;
     }
 
-    ngx_request.method.assign((char*) r->method_name.data, r->method_name.len);
-    ngx_request.client.assign((char*) r->connection->addr_text.data, r->connection->addr_text.len);
-    if (r->headers_in.user_agent->value.len > 0) {
-        ngx_request.user_agent.assign((char*) r->headers_in.user_agent->value.data, r->headers_in.user_agent->value.len);
+    ctx->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+    if (shm_zone->shm.exists) {
+        ctx->sh = (ngx_http_hi_cache_shctx_t*) ctx->shpool->data;
+        return NGX_OK;
     }
-    if (r->args.len > 0) {
-        hi::parser_param(ngx_request.param, ngx_request.form);
+
+    ctx->sh = (ngx_http_hi_cache_shctx_t*) ngx_slab_calloc(ctx->shpool, sizeof (ngx_http_hi_cache_shctx_t));
+    if (ctx->sh == NULL) {
+        return NGX_ERROR;
     }
-    if (r->headers_in.content_length_n > 0) {
-        ngx_str_t body = get_input_body(r);
-        hi::parser_param(std::string((char*) body.data, body.len), ngx_request.form);
+    ctx->shpool->data = ctx->sh;
+    ngx_rbtree_init(&ctx->sh->rbtree, &ctx->sh->sentinel, ngx_http_hi_cache_rbtree_insert_value);
+    ngx_queue_init(&ctx->sh->queue);
+
+    len = sizeof (" in hi cache zone \"\"") + shm_zone->shm.name.len;
+    ctx->shpool->log_ctx = (u_char*) ngx_slab_alloc(ctx->shpool, len);
+    if (ctx->shpool->log_ctx == NULL) {
+        return NGX_ERROR;
     }
-    if (conf->need_cookies == 1 && r->headers_in.cookies.elts != NULL && r->headers_in.cookies.nelts != 0) {
-        ngx_table_elt_t ** cookies = (ngx_table_elt_t **) r->headers_in.cookies.elts;
-        for (size_t i = 0; i < r->headers_in.cookies.nelts; ++i) {
-            if (cookies[i]->value.data != NULL) {
-                hi::parser_param(std::string((char*) cookies[i]->value.data, cookies[i]->value.len), ngx_request.cookies, ';');
-            }
+    ngx_sprintf(ctx->shpool->log_ctx, " in hi cache zone \"%V\"%Z", &shm_zone->shm.name);
+    ctx->shpool->log_nomem = 0;
+    return NGX_OK;
+}
+
+static void ngx_http_hi_cache_rbtree_insert_value(ngx_rbtree_node_t *temp, ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel) {
+    ngx_rbtree_node_t **p;
+    for (;;) {
+        if (node->key < temp->key) {
+            p = &temp->left;
+        } else if (node->key > temp->key) {
+            p = &temp->right;
+        } else {
+            p = (ngx_memcmp(((ngx_http_hi_cache_node_t*) node)->key, ((ngx_http_hi_cache_node_t*) temp)->key, 16) < 0)
+                    ? &temp->left : &temp->right;
+        }
+        if (*p == sentinel) {
+            break;
         }
+        temp = *p;
     }
-    if (conf->need_session == 1 && ngx_request.cookies.find(SESSION_ID_NAME) != ngx_request.cookies.end()) {
-        if (!REDIS) {
-            REDIS = std::make_shared<hi::redis>();
+    *p = node;
+    node->parent = temp;
+    node->left = sentinel;
+    node->right = sentinel;
+    ngx_rbt_red(node);
+}
+
+static ngx_http_hi_cache_node_t *ngx_http_hi_cache_lookup(ngx_http_hi_cache_zone_ctx_t *ctx, u_char *key) {
+    ngx_rbtree_key_t hash;
+    ngx_rbtree_node_t *node, *sentinel;
+    ngx_int_t rc;
+
+    ngx_memcpy(&hash, key, sizeof (ngx_rbtree_key_t));
+    node = ctx->sh->rbtree.root;
+    sentinel = ctx->sh->rbtree.sentinel;
+    while (node != sentinel) {
+        if (hash < node->key) {
+            node = node->left;
+            continue;
+        }
+        if (hash > node->key) {
+            node = node->right;
+            continue;
         }
-        if (REDIS && !REDIS->is_connected() && conf->redis_host.len > 0 && conf->redis_port > 0) {
-            REDIS->connect((char*) conf->redis_host.data, (int) conf->redis_port);
+        rc = ngx_memcmp(key, ((ngx_http_hi_cache_node_t*) node)->key, 16);
+        if (rc == 0) {
+            return (ngx_http_hi_cache_node_t*) node;
         }
-        if (REDIS && REDIS->is_connected()) {
-            SESSION_ID_VALUE = ngx_request.cookies[SESSION_ID_NAME ];
-            if (!REDIS->exists(SESSION_ID_VALUE)) {
-                REDIS->hset(SESSION_ID_VALUE, SESSION_ID_NAME, SESSION_ID_VALUE);
-                REDIS->expire(SESSION_ID_VALUE, conf->session_expires);
-                ngx_request.session[SESSION_ID_NAME] = SESSION_ID_VALUE;
+        node = (rc < 0) ? node->left : node->right;
+    }
+    return NULL;
+}
+
+static void ngx_http_hi_cache_delete(ngx_http_hi_cache_zone_ctx_t *ctx, ngx_http_hi_cache_node_t *cn) {
+    ctx->sh->bytes -= cn->header_len + cn->content_len;
+    ctx->sh->entries--;
+    ngx_queue_remove(&cn->queue);
+    ngx_rbtree_delete(&ctx->sh->rbtree, &cn->node);
+    ngx_slab_free_locked(ctx->shpool, cn);
+}
+
+/*
+ * NGX_OK for a fresh entry and NGX_DECLINED for none. With a lease an
+ * expired entry is kept, NGX_AGAIN returns it and hands its refresh to the
+ * caller for lease seconds, NGX_BUSY returns it while a request of any
+ * worker is refreshing it.
+ */
+/*
+ * The entry is copied into pool memory while the zone is locked, and only
+ * into ele once it is unlocked, so nothing that throws runs under the lock.
+ */
+static ngx_int_t ngx_http_hi_cache_zone_get(ngx_shm_zone_t *shm_zone, u_char *key, time_t expires, time_t lease, ngx_pool_t *pool, cache_ele_t& ele) {
+    ngx_http_hi_cache_zone_ctx_t *ctx = (ngx_http_hi_cache_zone_ctx_t*) shm_zone->data;
+    ngx_http_hi_cache_node_t *cn;
+    ngx_int_t rc = NGX_DECLINED;
+    time_t now = time(NULL);
+    u_char *data = NULL;
+    size_t header_len = 0, content_len = 0;
+
+    ngx_shmtx_lock(&ctx->shpool->mutex);
+    cn = ngx_http_hi_cache_lookup(ctx, key);
+    if (cn) {
+        if (difftime(now, cn->t) <= expires) {
+            rc = NGX_OK;
+        } else if (lease == 0) {
+            ngx_http_hi_cache_delete(ctx, cn);
+        } else if (cn->updating < now) {
+            cn->updating = now + lease;
+            rc = NGX_AGAIN;
+        } else {
+            rc = NGX_BUSY;
+        }
+        if (rc != NGX_DECLINED) {
+            ngx_queue_remove(&cn->queue);
+            ngx_queue_insert_head(&ctx->sh->queue, &cn->queue);
+            header_len = cn->header_len;
+            content_len = cn->content_len;
+            data = (u_char*) ngx_pnalloc(pool, header_len + content_len + 1);
+            if (data == NULL) {
+                rc = NGX_DECLINED;
             } else {
-                REDIS->hgetall(SESSION_ID_VALUE, ngx_request.session);
+                ngx_memcpy(data, cn->data, header_len + content_len);
+                ele.status = cn->status;
+                ele.t = cn->t;
             }
         }
     }
+    ngx_shmtx_unlock(&ctx->shpool->mutex);
+    if (data) {
+        ele.header.assign((char*) data, header_len);
+        ele.content.assign((char*) data + header_len, content_len);
+    }
+    return rc;
+}
+
+static void ngx_http_hi_cache_zone_put(ngx_shm_zone_t *shm_zone, u_char *key, const cache_ele_t& ele) {
+    ngx_http_hi_cache_zone_ctx_t *ctx = (ngx_http_hi_cache_zone_ctx_t*) shm_zone->data;
+    ngx_http_hi_cache_node_t *cn;
+    ngx_queue_t *q;
+    size_t size = offsetof(ngx_http_hi_cache_node_t, data) + ele.header.size() + ele.content.size();
+
+    if (size > shm_zone->shm.size / 8) {
+        return;
+    }
+
+    ngx_shmtx_lock(&ctx->shpool->mutex);
+    cn = ngx_http_hi_cache_lookup(ctx, key);
+    if (cn) {
+        ngx_http_hi_cache_delete(ctx, cn);
+    }
+    cn = (ngx_http_hi_cache_node_t*) ngx_slab_alloc_locked(ctx->shpool, size);
+    while (cn == NULL && !ngx_queue_empty(&ctx->sh->queue)) {
+        q = ngx_queue_last(&ctx->sh->queue);
+        ngx_http_hi_cache_delete(ctx, ngx_queue_data(q, ngx_http_hi_cache_node_t, queue));
+        ctx->sh->evictions++;
+        cn = (ngx_http_hi_cache_node_t*) ngx_slab_alloc_locked(ctx->shpool, size);
+    }
+    if (cn) {
+        ngx_memcpy(&cn->node.key, key, sizeof (ngx_rbtree_key_t));
+        ngx_memcpy(cn->key, key, 16);
+        cn->t = ele.t;
+        cn->updating = 0;
+        cn->status = ele.status;
+        cn->header_len = ele.header.size();
+        cn->content_len = ele.content.size();
+        ngx_memcpy(ngx_cpymem(cn->data, ele.header.data(), cn->header_len), ele.content.data(), cn->content_len);
+        ngx_rbtree_insert(&ctx->sh->rbtree, &cn->node);
+        ngx_queue_insert_head(&ctx->sh->queue, &cn->queue);
+        ctx->sh->bytes += cn->header_len + cn->content_len;
+        ctx->sh->entries++;
+    }
+    ngx_shmtx_unlock(&ctx->shpool->mutex);
+}
+
+static ngx_int_t ngx_http_hi_handler(ngx_http_request_t *r) {
+    if (r->headers_in.content_length_n > 0 || r->headers_in.chunked) {
+        // any body is read, a large one is left in its temporary file
+        r->request_body_file_log_level = 0;
+        ngx_int_t rc = ngx_http_read_client_request_body(r, ngx_http_hi_body_handler);
+        if (rc >= NGX_HTTP_SPECIAL_RESPONSE) {
+            return rc;
+        }
+        return NGX_DONE;
+    } else {
+        ngx_http_discard_request_body(r);
+        return ngx_http_hi_normal_handler(r);
+    }
+}
+
+static void ngx_http_hi_fill_request(ngx_http_hi_loc_conf_t *conf, ngx_http_hi_ctx_t *ctx) {
+    hi::request& ngx_request = ctx->req;
+    hi::ngx_request& view = ctx->view;
+    hi::string_view tmp;
+
+    tmp = view.uri();
+    ngx_request.uri.assign(tmp.data(), tmp.size());
+    tmp = view.param();
+    ngx_request.param.assign(tmp.data(), tmp.size());
+    tmp = view.method();
+    ngx_request.method.assign(tmp.data(), tmp.size());
+    tmp = view.client();
+    ngx_request.client.assign(tmp.data(), tmp.size());
+    tmp = view.user_agent();
+    ngx_request.user_agent.assign(tmp.data(), tmp.size());
+    if (conf->need_headers == 1) {
+        for (const hi::field& item : view.headers()) {
+            ngx_request.headers[item.key.to_string()] = item.value.to_string();
+        }
+    }
+    for (const hi::field& item : view.form()) {
+        ngx_request.form[item.key.to_string()] = item.value.to_string();
+    }
+    if (conf->need_cookies == 1) {
+        for (const hi::field& item : view.cookies()) {
+            ngx_request.cookies[item.key.to_string()] = item.value.to_string();
+        }
+    }
+}
+
+static ngx_int_t ngx_http_hi_normal_handler(ngx_http_request_t *r) {
+
+    ngx_http_hi_loc_conf_t * conf = (ngx_http_hi_loc_conf_t *) ngx_http_get_module_loc_conf(r, ngx_http_hi_module);
+    // only the refresh of ngx_http_hi_cache_refresh comes with a ctx
+    ngx_http_hi_ctx_t *ctx = (ngx_http_hi_ctx_t*) ngx_http_get_module_ctx(r, ngx_http_hi_module);
+
+    if (ctx == NULL && r->headers_in.if_modified_since && r->headers_in.if_modified_since->value.data) {
+        time_t now = time(NULL), old = ngx_http_parse_time(r->headers_in.if_modified_since->value.data, r->headers_in.if_modified_since->value.len);
+        if (difftime(now, old) <= conf->cache_expires) {
+            return NGX_HTTP_NOT_MODIFIED;
+        }
+    }
+
+    if (ctx == NULL && (ctx = ngx_http_hi_create_ctx(r)) == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    if (conf->use_cache == 1) {
+        ctx->res.headers.insert(std::make_pair("Last-Modified", (char*) ngx_cached_http_time.data));
+        ctx->cache_k = cache::hash128(r->uri.data, r->uri.len);
+        if (r->args.len > 0) {
+            ctx->cache_k = cache::hash128(r->args.data, r->args.len, ctx->cache_k);
+        }
+        ngx_int_t rc = ctx->cache_refresh ? NGX_DECLINED : ngx_http_hi_cache_handler(r, ctx);
+        if (rc != NGX_DECLINED) {
+            return rc;
+        }
+    }
+    return ngx_http_hi_start(r, ctx);
+}
+
+/*
+ * Runs the location again in a background subrequest, which stores what
+ * the handler returns and sends nothing, the client already has the old
+ * entry. nginx before 1.13.1 has no background subrequests, the request
+ * then refreshes the entry itself.
+ */
+static ngx_int_t ngx_http_hi_cache_refresh(ngx_http_request_t *r) {
+#if defined(NGX_HTTP_SUBREQUEST_BACKGROUND)
+    ngx_http_request_t *sr;
+    ngx_http_hi_ctx_t *ctx;
+    if (ngx_http_subrequest(r, &r->uri, &r->args, &sr, NULL, NGX_HTTP_SUBREQUEST_CLONE | NGX_HTTP_SUBREQUEST_BACKGROUND) != NGX_OK
+            || (ctx = ngx_http_hi_create_ctx(sr)) == NULL) {
+        return NGX_ERROR;
+    }
+    ctx->cache_refresh = true;
+    return NGX_OK;
+#else
+    return NGX_DECLINED;
+#endif
+}
+
+/*
+ * Answers from the cache, or returns NGX_DECLINED for the request to fill
+ * or refresh the entry. With hi_cache_lock only one request of the worker
+ * fills a missing entry, the others wait until it is there or for
+ * hi_cache_lock_timeout. With hi_cache_use_stale updating an expired entry
+ * is refreshed in the background while every request gets the old one.
+ */
+static ngx_int_t ngx_http_hi_cache_handler(ngx_http_request_t *r, ngx_http_hi_ctx_t *ctx) {
+    ngx_http_hi_loc_conf_t * conf = (ngx_http_hi_loc_conf_t *) ngx_http_get_module_loc_conf(r, ngx_http_hi_module);
+    hi::response& ngx_response = ctx->res;
+    time_t lease = conf->cache_use_stale ? (time_t) ngx_max(conf->cache_lock_timeout / 1000, 1) : 0;
+    ngx_int_t rc = NGX_DECLINED;
+
+    cache_ele_t zone_v, *cache_v = NULL;
+
+    if (conf->cache_zone) {
+        rc = ngx_http_hi_cache_zone_get(conf->cache_zone, (u_char*) &ctx->cache_k, conf->cache_expires, lease, r->pool, zone_v);
+        cache_v = &zone_v;
+    } else if ((cache_v = CACHE[conf->cache_index]->find(ctx->cache_k)) != NULL) {
+        time_t now = time(NULL);
+        if (difftime(now, cache_v->t) <= conf->cache_expires) {
+            rc = NGX_OK;
+        } else if (lease == 0) {
+            CACHE[conf->cache_index]->erase(ctx->cache_k);
+        } else if (cache_v->updating < now) {
+            cache_v->updating = now + lease;
+            rc = NGX_AGAIN;
+        } else {
+            rc = NGX_BUSY;
+        }
+    }
+    // without a refresh in the background this request does it
+    if (rc == NGX_AGAIN && ngx_http_hi_cache_refresh(r) != NGX_OK) {
+        return NGX_DECLINED;
+    }
+    if (rc == NGX_OK || rc == NGX_BUSY || rc == NGX_AGAIN) {
+        ngx_response.content = cache_v->content;
+        ngx_response.headers.find("Content-Type")->second = cache_v->header;
+        ngx_response.status = cache_v->status;
+        return ngx_http_hi_send_response(r, ctx);
+    }
+    if (conf->cache_lock != 1 || ctx->cache_nolock) {
+        return NGX_DECLINED;
+    }
+
+    auto lock = CACHE_LOCK.find(ctx->cache_k);
+    if (lock == CACHE_LOCK.end()) {
+        CACHE_LOCK[ctx->cache_k];
+        ctx->cache_locked = true;
+        return NGX_DECLINED;
+    }
+    lock->second.push_back(r);
+    ctx->cache_waiting = true;
+    ctx->wait.handler = ngx_http_hi_cache_wait_handler;
+    ctx->wait.data = r;
+    ctx->wait.log = r->connection->log;
+    ngx_add_timer(&ctx->wait, conf->cache_lock_timeout);
+    r->main->count++;
+    return NGX_DONE;
+}
+
+/*
+ * Woken once the entry was filled, or timed out. Either way the request
+ * looks again and runs the handler itself when the entry is still missing.
+ */
+static void ngx_http_hi_cache_wait_handler(ngx_event_t *ev) {
+    ngx_http_request_t *r = (ngx_http_request_t*) ev->data;
+    ngx_connection_t *c = r->connection;
+    ngx_http_hi_ctx_t *ctx = (ngx_http_hi_ctx_t*) ngx_http_get_module_ctx(r, ngx_http_hi_module);
+
+    if (ctx->cache_waiting) {
+        ngx_http_hi_cache_unwait(r, ctx);
+    }
+    ctx->cache_nolock = true;
+    ngx_int_t rc = ngx_http_hi_cache_handler(r, ctx);
+    if (rc == NGX_DECLINED) {
+        rc = ngx_http_hi_start(r, ctx);
+    }
+    ngx_http_finalize_request(r, rc);
+    ngx_http_run_posted_requests(c);
+}
+
+static void ngx_http_hi_cache_unlock(ngx_http_hi_ctx_t *ctx) {
+    ctx->cache_locked = false;
+    auto lock = CACHE_LOCK.find(ctx->cache_k);
+    if (lock == CACHE_LOCK.end()) {
+        return;
+    }
+    std::vector<ngx_http_request_t*> waiting(std::move(lock->second));
+    CACHE_LOCK.erase(lock);
+    for (ngx_http_request_t *r : waiting) {
+        ngx_http_hi_ctx_t *w = (ngx_http_hi_ctx_t*) ngx_http_get_module_ctx(r, ngx_http_hi_module);
+        w->cache_waiting = false;
+        if (w->wait.timer_set) {
+            ngx_del_timer(&w->wait);
+        }
+        ngx_post_event(&w->wait, &ngx_posted_events);
+    }
+}
+
+static void ngx_http_hi_cache_unwait(ngx_http_request_t *r, ngx_http_hi_ctx_t *ctx) {
+    ctx->cache_waiting = false;
+    auto lock = CACHE_LOCK.find(ctx->cache_k);
+    if (lock != CACHE_LOCK.end()) {
+        std::vector<ngx_http_request_t*>& waiting = lock->second;
+        waiting.erase(std::remove(waiting.begin(), waiting.end(), r), waiting.end());
+    }
+}
+
+static ngx_int_t ngx_http_hi_start(ngx_http_request_t *r, ngx_http_hi_ctx_t *ctx) {
+    ngx_http_hi_loc_conf_t * conf = (ngx_http_hi_loc_conf_t *) ngx_http_get_module_loc_conf(r, ngx_http_hi_module);
+    hi::request& ngx_request = ctx->req;
+    hi::string_view session_id;
+
+    // servlets reading through a request_view parse only what they use
+    if (conf->app_type != cpp || !PLUGIN[conf->module_index]->is_view()) {
+        ngx_http_hi_fill_request(conf, ctx);
+    }
+    if (conf->need_session == 1 && conf->redis_index != NGX_CONF_UNSET && ctx->view.cookies().find(SESSION_ID_NAME, session_id)) {
+        bool tracked = false;
+        ctx->session_id.assign(session_id.data(), session_id.size());
+        ctx->redis = REDIS[conf->redis_index]->get(ctx->session_id, &tracked);
+        if (ctx->redis && tracked && conf->session_cache_size > 0) {
+            session_cache_t& session_cache = *SESSION[conf->redis_index];
+            session_ele_t* session_v = session_cache.find(ctx->session_id);
+            ctx->session_cache = true;
+            if (session_v && session_v->expires > time(NULL)) {
+                ngx_request.session = session_v->data;
+                ctx->session_expires = session_v->expires;
+                return ngx_http_hi_run(r, ctx);
+            }
+            // a placeholder that an invalidation arriving before the reply removes
+            if (session_v == NULL || session_v->expires > 0) {
+                session_cache.emplace(std::string(ctx->session_id));
+            }
+        }
+        hi::redis_batch batch;
+        batch.add({"MULTI"})
+                .add({"HGETALL", ctx->session_id})
+                .add({"TTL", ctx->session_id})
+                .add({"EXEC"});
+        if (ctx->redis) {
+            ngx_http_hi_redis_wait_t *wait = new ngx_http_hi_redis_wait_t();
+            wait->r = r;
+            if (ctx->redis->flush(ngx_http_hi_session_handler, wait, batch)) {
+                ngx_http_hi_redis_wait(r, ctx, wait, ngx_http_hi_session_timeout_handler);
+                r->main->count++;
+                return NGX_DONE;
+            }
+            delete wait;
+        }
+        ctx->session_id.clear();
+        ctx->redis = 0;
+        ctx->session_cache = false;
+    }
+    return ngx_http_hi_run(r, ctx);
+}
+
+static void ngx_http_hi_redis_wait(ngx_http_request_t *r, ngx_http_hi_ctx_t *ctx, ngx_http_hi_redis_wait_t *wait, ngx_event_handler_pt handler) {
+    ngx_http_hi_loc_conf_t * conf = (ngx_http_hi_loc_conf_t *) ngx_http_get_module_loc_conf(r, ngx_http_hi_module);
+    ctx->redis_wait = wait;
+    ctx->redis_timer.handler = handler;
+    ctx->redis_timer.data = r;
+    ctx->redis_timer.log = r->connection->log;
+    ngx_add_timer(&ctx->redis_timer, conf->redis_timeout);
+}
+
+// the reply, whenever it comes, is dropped
+static void ngx_http_hi_redis_unwait(ngx_http_hi_ctx_t *ctx) {
+    if (ctx->redis_wait) {
+        ctx->redis_wait->r = NULL;
+        ctx->redis_wait = 0;
+    }
+    if (ctx->redis_timer.timer_set) {
+        ngx_del_timer(&ctx->redis_timer);
+    }
+}
+
+/*
+ * Also called with a NULL reply when the connection fails or its client is
+ * destroyed, the request then runs without a session.
+ */
+static void ngx_http_hi_session_handler(redisAsyncContext *ac, void *reply, void *privdata) {
+    ngx_http_hi_redis_wait_t *wait = (ngx_http_hi_redis_wait_t*) privdata;
+    ngx_http_request_t *r = wait->r;
+    delete wait;
+    // the request was terminated or timed out while the reply was on its way
+    if (r == NULL) {
+        return;
+    }
+    ngx_connection_t *c = r->connection;
+    ngx_http_hi_loc_conf_t * conf = (ngx_http_hi_loc_conf_t *) ngx_http_get_module_loc_conf(r, ngx_http_hi_module);
+    ngx_http_hi_ctx_t *ctx = (ngx_http_hi_ctx_t*) ngx_http_get_module_ctx(r, ngx_http_hi_module);
+    redisReply *rep = (redisReply*) reply, *hash, *ttl;
+    time_t now = time(NULL);
+
+    ctx->redis_wait = 0;
+    ngx_http_hi_redis_unwait(ctx);
+
+    // EXEC replies with the HGETALL and TTL results
+    if (ac->data == NULL || rep == NULL || rep->type != REDIS_REPLY_ARRAY || rep->elements != 2
+            || rep->element[0]->type != REDIS_REPLY_ARRAY || rep->element[1]->type != REDIS_REPLY_INTEGER) {
+        ctx->session_id.clear();
+        ctx->redis = 0;
+        ctx->session_cache = false;
+    } else if ((hash = rep->element[0])->elements == 0) {
+        // the server stops tracking the key once it is written here
+        if (ctx->session_cache) {
+            SESSION[conf->redis_index]->erase(ctx->session_id);
+            ctx->session_cache = false;
+        }
+        hi::redis_batch batch;
+        batch.add({"HSET", ctx->session_id, SESSION_ID_NAME, ctx->session_id})
+                .add({"EXPIRE", ctx->session_id, std::to_string(conf->session_expires)});
+        ctx->redis->flush(NULL, NULL, batch);
+        ctx->req.session[SESSION_ID_NAME] = ctx->session_id;
+        ctx->session_expires = now + conf->session_expires;
+    } else {
+        std::string k, v;
+        for (size_t i = 0; i + 1 < hash->elements; i += 2) {
+            ctx->req.session[k.assign(hash->element[i]->str, hash->element[i]->len)] = v.assign(hash->element[i + 1]->str, hash->element[i + 1]->len);
+        }
+        ttl = rep->element[1];
+        ctx->session_expires = ttl->integer > 0 ? now + (time_t) ttl->integer : now;
+    }
+    if (ctx->session_cache) {
+        session_ele_t* session_v = SESSION[conf->redis_index]->find(ctx->session_id);
+        if (session_v && session_v->expires == 0) {
+            session_v->data = ctx->req.session;
+            session_v->expires = ctx->session_expires;
+        }
+    }
+
+    ngx_http_finalize_request(r, ngx_http_hi_run(r, ctx));
+    ngx_http_run_posted_requests(c);
+}
+
+static void ngx_http_hi_session_timeout_handler(ngx_event_t *ev) {
+    ngx_http_request_t *r = (ngx_http_request_t*) ev->data;
+    ngx_connection_t *c = r->connection;
+    ngx_http_hi_ctx_t *ctx = (ngx_http_hi_ctx_t*) ngx_http_get_module_ctx(r, ngx_http_hi_module);
+
+    ngx_log_error(NGX_LOG_ERR, c->log, NGX_ETIMEDOUT, "redis session read timed out, running without a session");
+    ngx_http_hi_redis_unwait(ctx);
+    ctx->session_id.clear();
+    ctx->redis = 0;
+    ctx->session_cache = false;
+
+    ngx_http_finalize_request(r, ngx_http_hi_run(r, ctx));
+    ngx_http_run_posted_requests(c);
+}
+
+static ngx_int_t ngx_http_hi_run(ngx_http_request_t *r, ngx_http_hi_ctx_t *ctx) {
+    ngx_http_hi_loc_conf_t * conf = (ngx_http_hi_loc_conf_t *) ngx_http_get_module_loc_conf(r, ngx_http_hi_module);
+    hi::response& ngx_response = ctx->res;
+
+#if (NGX_THREADS)
+    if ((conf->app_type == cpp || conf->app_type == python) && conf->thread_pool_index != NGX_CONF_UNSET) {
+        ngx_http_hi_thread_pool_t& tp = THREAD_POOL[conf->thread_pool_index];
+        ngx_thread_task_t *task = ngx_thread_task_alloc(r->pool, sizeof (ngx_http_request_t*));
+        if (task == NULL) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+        *(ngx_http_request_t**) task->ctx = r;
+        ctx->view.parse_all();
+        ngx_response.pool = NULL;
+        task->handler = ngx_http_hi_thread_handler;
+        task->event.data = r;
+        task->event.handler = ngx_http_hi_thread_event_handler;
+        if (ngx_thread_task_post(tp.pool, task) != NGX_OK) {
+            ++tp.rejected;
+            return NGX_HTTP_SERVICE_UNAVAILABLE;
+        }
+        ++tp.queued;
+        r->main->blocked++;
+        r->main->count++;
+        r->aio = 1;
+        return NGX_DONE;
+    }
+#endif
+
     switch (conf->app_type) {
-        case cpp:ngx_http_hi_cpp_handler(conf, ngx_request, ngx_response);
+        case cpp:ngx_http_hi_cpp_handler(conf, ctx);
             break;
-        case python:ngx_http_hi_python_handler(conf, ngx_request, ngx_response);
+        case python:ngx_http_hi_python_handler(conf, ctx->req, &ctx->view, ngx_response, &ctx->gil);
             break;
-        case lua:ngx_http_hi_lua_handler(conf, ngx_request, ngx_response);
+        case lua:
+            if (ngx_http_hi_lua_start(conf, r, ctx) == hi::lua::yielded) {
+                r->main->count++;
+                return NGX_DONE;
+            }
             break;
         default:break;
     }
 
-    if (conf->need_cache == 1 && conf->cache_expires > 0) {
+    return ngx_http_hi_finish(r, ctx);
+}
+
+#if (NGX_THREADS)
+
+static void ngx_http_hi_thread_handler(void *data, ngx_log_t *log) {
+    ngx_http_request_t *r = *(ngx_http_request_t**) data;
+    ngx_http_hi_loc_conf_t * conf = (ngx_http_hi_loc_conf_t *) ngx_http_get_module_loc_conf(r, ngx_http_hi_module);
+    ngx_http_hi_ctx_t *ctx = (ngx_http_hi_ctx_t*) ngx_http_get_module_ctx(r, ngx_http_hi_module);
+    if (conf->app_type == python) {
+        ngx_http_hi_python_handler(conf, ctx->req, &ctx->view, ctx->res, &ctx->gil);
+    } else {
+        ngx_http_hi_cpp_handler(conf, ctx);
+    }
+}
+
+static void ngx_http_hi_thread_event_handler(ngx_event_t *ev) {
+    ngx_http_request_t *r = (ngx_http_request_t*) ev->data;
+    ngx_connection_t *c = r->connection;
+    ngx_http_hi_loc_conf_t * conf = (ngx_http_hi_loc_conf_t *) ngx_http_get_module_loc_conf(r, ngx_http_hi_module);
+    ngx_http_hi_ctx_t *ctx = (ngx_http_hi_ctx_t*) ngx_http_get_module_ctx(r, ngx_http_hi_module);
+
+    --THREAD_POOL[conf->thread_pool_index].queued;
+    r->main->blocked--;
+    r->aio = 0;
+
+    // the request was terminated while the servlet was running
+    if (c->error) {
+        ngx_http_finalize_request(r, NGX_ERROR);
+    } else {
+        ngx_http_finalize_request(r, ngx_http_hi_finish(r, ctx));
+    }
+    ngx_http_run_posted_requests(c);
+}
+#endif
+
+static ngx_int_t ngx_http_hi_finish(ngx_http_request_t *r, ngx_http_hi_ctx_t *ctx) {
+    ngx_http_hi_loc_conf_t * conf = (ngx_http_hi_loc_conf_t *) ngx_http_get_module_loc_conf(r, ngx_http_hi_module);
+    hi::response& ngx_response = ctx->res;
+
+    if (conf->use_cache == 1 && conf->cache_expires > 0 && !ngx_response.producer) {
         cache_ele_t cache_v;
-        cache_v.content = ngx_response.content;
+        cache_v.content = ngx_response.body();
         cache_v.header = ngx_response.headers.find("Content-Type")->second;
         cache_v.status = ngx_response.status;
         cache_v.t = time(NULL);
-        CACHE[conf->cache_index]->put(*cache_k, cache_v);
+        if (conf->cache_zone) {
+            ngx_http_hi_cache_zone_put(conf->cache_zone, (u_char*) &ctx->cache_k, cache_v);
+        } else {
+            CACHE[conf->cache_index]->put(cache::key128(ctx->cache_k), std::move(cache_v));
+        }
+    }
+    if (ctx->cache_locked) {
+        ngx_http_hi_cache_unlock(ctx);
     }
-    if (REDIS && REDIS->is_connected() && !SESSION_ID_VALUE.empty()) {
-        REDIS->hmset(SESSION_ID_VALUE, ngx_response.session);
+    if (ctx->redis) {
+        ngx_http_hi_session_write_back(conf, ctx);
+    }
+    if (ctx->cache_refresh) {
+        return NGX_OK;
     }
 
-done:
-    ngx_str_t response;
-    response.data = (u_char*) ngx_response.content.c_str();
-    response.len = ngx_response.content.size();
+    return ngx_http_hi_send_response(r, ctx);
+}
 
+static void ngx_http_hi_session_write_back(ngx_http_hi_loc_conf_t *conf, ngx_http_hi_ctx_t *ctx) {
+    const std::unordered_map<std::string, std::string>& old_session = ctx->req.session;
+    hi::response& ngx_response = ctx->res;
+    hi::redis_batch::command_t set{"HMSET", ctx->session_id}, del{"HDEL", ctx->session_id};
+    hi::redis_batch batch;
+    time_t now = time(NULL);
+
+    for (const auto& item : ngx_response.session) {
+        auto old = old_session.find(item.first);
+        if (old == old_session.end() || old->second != item.second) {
+            set.push_back(item.first);
+            set.push_back(item.second);
+        }
+    }
+    for (const auto& item : ngx_response.session_deleted) {
+        if (ngx_response.session.find(item) == ngx_response.session.end() && old_session.find(item) != old_session.end()) {
+            del.push_back(item);
+        }
+    }
+    // read only requests only slide the expiry once half of it is used up
+    if (set.size() == 2 && del.size() == 2 && ctx->session_expires - now > conf->session_expires / 2) {
+        return;
+    }
+    if (set.size() > 2) {
+        batch.add(std::move(set));
+    }
+    if (del.size() > 2) {
+        batch.add(std::move(del));
+    }
+    batch.add({"EXPIRE", ctx->session_id, std::to_string(conf->session_expires)});
+    // any write, the sliding EXPIRE too, ends the server's tracking of the key
+    if (ctx->session_cache) {
+        SESSION[conf->redis_index]->erase(ctx->session_id);
+    }
+    ctx->redis->flush(NULL, NULL, batch);
+}
 
+static ngx_int_t ngx_http_hi_send_response(ngx_http_request_t *r, ngx_http_hi_ctx_t *ctx) {
+    hi::response& ngx_response = ctx->res;
+    ngx_chain_t *out = NULL, **ll = &out, *cl = NULL;
     ngx_buf_t *buf;
-    buf = (ngx_buf_t*) ngx_pcalloc(r->pool, sizeof (ngx_buf_t));
-    if (buf == NULL) {
-        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "Failed to allocate response buffer.");
-        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    size_t n = ngx_response.parts.size();
+
+    // content first, then the parts, all sent from where they are
+    for (size_t i = 0; i <= n; ++i) {
+        const char* data = i == 0 ? ngx_response.content.data() : ngx_response.parts[i - 1].data;
+        size_t len = i == 0 ? ngx_response.content.size() : ngx_response.parts[i - 1].size;
+        if (len == 0 && (i > 0 || n > 0 || ngx_response.producer)) {
+            continue;
+        }
+        buf = (ngx_buf_t*) ngx_calloc_buf(r->pool);
+        cl = ngx_alloc_chain_link(r->pool);
+        if (buf == NULL || cl == NULL) {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "Failed to allocate response buffer.");
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+        buf->pos = (u_char*) data;
+        buf->last = buf->pos + len;
+        buf->memory = 1;
+        cl->buf = buf;
+        cl->next = NULL;
+        *ll = cl;
+        ll = &cl->next;
     }
 
-    buf->pos = response.data;
-    buf->last = buf->pos + response.len;
-    buf->memory = 1;
-    buf->last_buf = 1;
-
-    ngx_chain_t out;
-    out.buf = buf;
-    out.next = NULL;
-
     set_output_headers(r, ngx_response.headers);
     r->headers_out.status = ngx_response.status;
-    r->headers_out.content_length_n = response.len;
 
     ngx_int_t rc;
+    if (ngx_response.producer) {
+        // without a known length the chunked filter frames the body
+        r->headers_out.content_length_n = ngx_response.stream_length < 0 ? -1 : (off_t) ngx_response.body_size() + ngx_response.stream_length;
+        rc = ngx_http_send_header(r);
+        if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+            return rc;
+        }
+        if (out && ngx_http_output_filter(r, out) == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+        rc = ngx_http_hi_stream(r, ctx);
+        if (rc == NGX_DONE) {
+            r->main->count++;
+        }
+        return rc;
+    }
+
+    cl->buf->last_buf = 1;
+    r->headers_out.content_length_n = ngx_response.body_size();
+
     rc = ngx_http_send_header(r);
     if (rc != NGX_OK) {
         return NGX_HTTP_INTERNAL_SERVER_ERROR;
     }
 
-    return ngx_http_output_filter(r, &out);
+    return ngx_http_output_filter(r, out);
 
 }
 
-static void ngx_http_hi_body_handler(ngx_http_request_t* r) {
-    ngx_http_finalize_request(r, ngx_http_hi_normal_handler(r));
-}
+/*
+ * Runs the producer and passes what it wrote down the filters until it is
+ * done, returns NGX_DONE when it has to wait for the client to take what
+ * was sent so far or has yielded to other connections.
+ */
+static ngx_int_t ngx_http_hi_stream(ngx_http_request_t *r, ngx_http_hi_ctx_t *ctx) {
+    ngx_http_hi_writer& writer = ctx->writer;
+    ngx_connection_t *c = r->connection;
+    ngx_int_t rc;
 
-static void get_input_headers(ngx_http_request_t* r, std::unordered_map<std::string, std::string>& input_headers) {
-    ngx_table_elt_t *th;
-    ngx_list_part_t *part;
-    part = &r->headers_in.headers.part;
-    th = (ngx_table_elt_t*) part->elts;
-    ngx_uint_t i;
-    for (i = 0; /* void */; i++) {
-        if (i >= part->nelts) {
-            if (part->next == NULL) {
-                break;
+    for (ngx_uint_t i = 0; i < STREAM_ROUNDS; ++i) {
+        // what was written before has to leave first, or a producer that is
+        // faster than the client grows the pool without bound
+        if (writer.busy) {
+            rc = ngx_http_output_filter(r, NULL);
+            ngx_chain_update_chains(r->pool, &writer.free, &writer.busy, &writer.out, (ngx_buf_tag_t) & ngx_http_hi_module);
+            if (rc == NGX_ERROR) {
+                return NGX_ERROR;
+            }
+            if (writer.busy) {
+                return ngx_http_hi_stream_wait(r);
+            }
+        }
+        if (!writer.done) {
+            bool more = false;
+            try {
+                more = ctx->res.producer(writer);
+            } catch (const std::exception& e) {
+                ngx_log_error(NGX_LOG_ERR, c->log, 0, "Response producer failed: %s", e.what());
+                return NGX_ERROR;
+            }
+            if (!more) {
+                writer.done = true;
+                writer.mark(false);
+            }
+            if (writer.failed) {
+                ngx_log_error(NGX_LOG_ERR, c->log, 0, "Failed to allocate response buffer.");
+                return NGX_ERROR;
             }
-            part = part->next;
-            th = (ngx_table_elt_t*) part->elts;
-            i = 0;
         }
-        input_headers[(char*) th[i].key.data] = std::move(std::string((char*) th[i].value.data, th[i].value.len));
+
+        rc = ngx_http_output_filter(r, writer.out);
+        ngx_chain_update_chains(r->pool, &writer.free, &writer.busy, &writer.out, (ngx_buf_tag_t) & ngx_http_hi_module);
+        writer.tail = NULL;
+
+        if (rc == NGX_ERROR || writer.done) {
+            return rc;
+        }
+        if (rc == NGX_AGAIN) {
+            return ngx_http_hi_stream_wait(r);
+        }
+    }
+
+    // let the other connections have their turn
+    r->write_event_handler = ngx_http_hi_stream_handler;
+    ngx_post_event(c->write, &ngx_posted_events);
+    return NGX_DONE;
+}
+
+// the send buffer is full, produce more once the client has read
+static ngx_int_t ngx_http_hi_stream_wait(ngx_http_request_t *r) {
+    ngx_connection_t *c = r->connection;
+    ngx_http_core_loc_conf_t *clcf = (ngx_http_core_loc_conf_t*) ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+    r->write_event_handler = ngx_http_hi_stream_handler;
+    if (!c->write->delayed) {
+        ngx_add_timer(c->write, clcf->send_timeout);
+    }
+    if (ngx_handle_write_event(c->write, clcf->send_lowat) != NGX_OK) {
+        return NGX_ERROR;
+    }
+    return NGX_DONE;
+}
+
+static void ngx_http_hi_stream_handler(ngx_http_request_t *r) {
+    ngx_connection_t *c = r->connection;
+    ngx_event_t *wev = c->write;
+    ngx_http_hi_ctx_t *ctx = (ngx_http_hi_ctx_t*) ngx_http_get_module_ctx(r, ngx_http_hi_module);
+
+    if (wev->timedout) {
+        ngx_log_error(NGX_LOG_INFO, c->log, NGX_ETIMEDOUT, "client timed out");
+        c->timedout = 1;
+        ngx_http_finalize_request(r, NGX_HTTP_REQUEST_TIME_OUT);
+        return;
+    }
+    if (wev->delayed) {
+        ngx_http_core_loc_conf_t *clcf = (ngx_http_core_loc_conf_t*) ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+        if (ngx_handle_write_event(wev, clcf->send_lowat) != NGX_OK) {
+            ngx_http_finalize_request(r, NGX_ERROR);
+        }
+        return;
+    }
+    if (wev->timer_set) {
+        ngx_del_timer(wev);
+    }
+
+    ngx_int_t rc = ngx_http_hi_stream(r, ctx);
+    if (rc != NGX_DONE) {
+        ngx_http_finalize_request(r, rc);
     }
 }
 
+static ngx_http_hi_ctx_t *ngx_http_hi_create_ctx(ngx_http_request_t *r) {
+    ngx_pool_cleanup_t *cln = ngx_pool_cleanup_add(r->pool, sizeof (ngx_http_hi_ctx_t));
+    if (cln == NULL) {
+        return NULL;
+    }
+    ngx_http_hi_ctx_t *ctx = new(cln->data) ngx_http_hi_ctx_t(r);
+    cln->handler = ngx_http_hi_ctx_cleanup;
+    ngx_http_set_ctx(r, ctx, ngx_http_hi_module);
+    return ctx;
+}
+
+static void ngx_http_hi_ctx_cleanup(void *data) {
+    ngx_http_hi_ctx_t *ctx = (ngx_http_hi_ctx_t*) data;
+    // a hi.redis task is released here and not by the reply
+    if (ctx->redis_wait && ctx->task) {
+        ctx->task->pending = false;
+    }
+    ngx_http_hi_redis_unwait(ctx);
+    if (ctx->cache_locked) {
+        ngx_http_hi_cache_unlock(ctx);
+    }
+    if (ctx->cache_waiting) {
+        ngx_http_hi_cache_unwait((ngx_http_request_t*) ctx->wait.data, ctx);
+    }
+    if (ctx->wait.timer_set) {
+        ngx_del_timer(&ctx->wait);
+    }
+    if (ctx->wait.posted) {
+        ngx_delete_posted_event(&ctx->wait);
+    }
+    if (ctx->task) {
+        if (ctx->sleep.timer_set) {
+            ngx_del_timer(&ctx->sleep);
+            ctx->task->pending = false;
+        }
+        ctx->lua->release(ctx->task);
+    }
+    ctx->~ngx_http_hi_ctx_t();
+}
+
+static void ngx_http_hi_body_handler(ngx_http_request_t* r) {
+    ngx_http_finalize_request(r, ngx_http_hi_normal_handler(r));
+}
+
 static void set_output_headers(ngx_http_request_t* r, std::unordered_multimap<std::string, std::string>& output_headers) {
     for (auto& item : output_headers) {
         ngx_table_elt_t * h = (ngx_table_elt_t *) ngx_list_push(&r->headers_out.headers);
@@ -548,96 +2064,273 @@ static void set_output_headers(ngx_http_request_t* r, std::unordered_multimap<st
 
 }
 
-static ngx_str_t get_input_body(ngx_http_request_t *r) {
-    u_char *p;
-    u_char *data;
-    size_t len;
-    ngx_buf_t *buf, *next;
-    ngx_chain_t *cl;
-    ngx_str_t body = ngx_null_string;
-
-    if (r->request_body == NULL || r->request_body->bufs == NULL) {
-        return body;
+static void ngx_http_hi_cpp_handler(ngx_http_hi_loc_conf_t * conf, ngx_http_hi_ctx_t *ctx) {
+    hi::module_class<hi::servlet>& plugin = *PLUGIN[conf->module_index];
+    hi::servlet* view_instance = plugin.acquire();
+    if (view_instance) {
+        if (plugin.is_view()) {
+            static_cast<hi::view_servlet*> (view_instance)->handler(ctx->view, ctx->res);
+        } else {
+            view_instance->handler(ctx->req, ctx->res);
+        }
+        plugin.release(view_instance);
     }
 
-    if (r->request_body->temp_file) {
-        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "temp_file: %s", r->request_body->temp_file->file.name.data);
-        body = r->request_body->temp_file->file.name;
-        return body;
-    } else {
-        cl = r->request_body->bufs;
-        buf = cl->buf;
-
-        if (cl->next == NULL) {
-            len = buf->last - buf->pos;
-            p = (u_char*) ngx_pnalloc(r->pool, len + 1);
-            if (p == NULL) {
-                return body;
-            }
-            data = p;
-            ngx_memcpy(p, buf->pos, len);
-            data[len] = 0;
+}
+
+/*
+ * Runs on the event loop or on a thread of the location's thread pool. A
+ * namespace is taken from the location's idle ones, or made, for the time
+ * the GIL is held, so concurrent requests never share hi_req and hi_res.
+ */
+static void ngx_http_hi_python_handler(ngx_http_hi_loc_conf_t * conf, hi::request& req, hi::request_view* view, hi::response& res, hi::boost_py::gil_time* time) {
+    hi::boost_py::gil lock(time);
+    std::vector<std::shared_ptr<hi::boost_py>>& idle = PYTHON[conf->script_index];
+    std::shared_ptr<hi::boost_py> interpreter;
+    try {
+        if (idle.empty()) {
+            interpreter = std::make_shared<hi::boost_py>();
         } else {
-            next = cl->next->buf;
-            len = (buf->last - buf->pos) + (next->last - next->pos);
-            p = (u_char*) ngx_pnalloc(r->pool, len + 1);
-            data = p;
-            if (p == NULL) {
-                return body;
-            }
-            p = ngx_cpymem(p, buf->pos, buf->last - buf->pos);
-            ngx_memcpy(p, next->pos, next->last - next->pos);
-            data[len] = 0;
+            interpreter = idle.back();
+            idle.pop_back();
         }
+    } catch (const boost::python::error_already_set&) {
+        PyErr_Clear();
+        res.status = 500;
+        return;
     }
+    interpreter->set(req, res, view);
+    if (conf->python_script.len > 0) {
+        interpreter->call_script(std::string((char*) conf->python_script.data, conf->python_script.len).append(req.uri), conf->script_cache_valid);
+    } else if (conf->python_content.len > 0) {
+        interpreter->call_content((char*) conf->python_content.data);
+    }
+    idle.push_back(interpreter);
+}
 
-    body.len = len;
-    body.data = data;
-    return body;
+static void ngx_http_hi_lua_handler(ngx_http_hi_loc_conf_t * conf, hi::request& req, hi::response& res) {
+    std::shared_ptr<hi::lua>& state = LUA[conf->script_index];
+    if (!state) {
+        state = std::make_shared<hi::lua>();
+        state->set_io(&LUA_IO);
+    }
+    if (conf->lua_script.len > 0) {
+        state->call_script(req, res, std::string((char*) conf->lua_script.data, conf->lua_script.len).append(req.uri), conf->script_cache_valid);
+    } else if (conf->lua_content.len > 0) {
+        state->call_content(req, res, (char*) conf->lua_content.data);
+    }
 }
 
-static void ngx_http_hi_cpp_handler(ngx_http_hi_loc_conf_t * conf, hi::request& req, hi::response& res) {
-    std::shared_ptr<hi::servlet> view_instance = std::move(PLUGIN[conf->module_index]->make_obj());
-    if (view_instance) {
-        view_instance->handler(req, res);
+/*
+ * Runs the request in a coroutine of the location's lua state, which is
+ * resumed by ngx_http_hi_lua_resume once what it yielded on is done.
+ */
+static hi::lua::status_t ngx_http_hi_lua_start(ngx_http_hi_loc_conf_t * conf, ngx_http_request_t *r, ngx_http_hi_ctx_t *ctx) {
+    std::shared_ptr<hi::lua>& state = LUA[conf->script_index];
+    if (!state) {
+        state = std::make_shared<hi::lua>();
+        state->set_io(&LUA_IO);
+    }
+    ctx->lua = state;
+    ctx->task = state->acquire(ctx->req, ctx->res, r, &ctx->view);
+    if (conf->lua_script.len > 0) {
+        return state->start_script(ctx->task, std::string((char*) conf->lua_script.data, conf->lua_script.len).append(ctx->req.uri), conf->script_cache_valid);
+    } else if (conf->lua_content.len > 0) {
+        return state->start_content(ctx->task, (char*) conf->lua_content.data);
     }
+    return hi::lua::done;
+}
 
+static void ngx_http_hi_lua_resume(ngx_http_request_t *r, ngx_http_hi_ctx_t *ctx, int nargs) {
+    if (ctx->lua->resume(ctx->task, nargs) == hi::lua::yielded) {
+        return;
+    }
+    ngx_http_finalize_request(r, ngx_http_hi_finish(r, ctx));
 }
 
-static void ngx_http_hi_python_handler(ngx_http_hi_loc_conf_t * conf, hi::request& req, hi::response& res) {
-    hi::py_request py_req;
-    hi::py_response py_res;
-    py_req.init(&req);
-    py_res.init(&res);
-    if (!PYTHON) {
-        PYTHON = std::make_shared<hi::boost_py>();
+bool ngx_http_hi_lua_io::sleep(hi::lua::task* t, long msec) {
+    ngx_http_request_t *r = (ngx_http_request_t*) t->data;
+    if (r == NULL) {
+        return false;
     }
-    if (PYTHON) {
-        PYTHON->set_req(&py_req);
-        PYTHON->set_res(&py_res);
-        if (conf->python_script.len > 0) {
-            PYTHON->call_script(std::string((char*) conf->python_script.data, conf->python_script.len).append(req.uri));
-        } else if (conf->python_content.len > 0) {
-            PYTHON->call_content((char*) conf->python_content.data);
-        }
+    ngx_http_hi_ctx_t *ctx = (ngx_http_hi_ctx_t*) ngx_http_get_module_ctx(r, ngx_http_hi_module);
+    ctx->sleep.handler = ngx_http_hi_lua_sleep_handler;
+    ctx->sleep.data = r;
+    ctx->sleep.log = r->connection->log;
+    ngx_add_timer(&ctx->sleep, msec > 0 ? (ngx_msec_t) msec : 0);
+    t->pending = true;
+    return true;
+}
+
+static void ngx_http_hi_lua_sleep_handler(ngx_event_t *ev) {
+    ngx_http_request_t *r = (ngx_http_request_t*) ev->data;
+    ngx_connection_t *c = r->connection;
+    ngx_http_hi_ctx_t *ctx = (ngx_http_hi_ctx_t*) ngx_http_get_module_ctx(r, ngx_http_hi_module);
+    ctx->task->pending = false;
+    ngx_http_hi_lua_resume(r, ctx, 0);
+    ngx_http_run_posted_requests(c);
+}
+
+// the connection is picked by the key, the first argument after the command
+bool ngx_http_hi_lua_io::redis(hi::lua::task* t, const std::vector<std::string>& cmd) {
+    ngx_http_request_t *r = (ngx_http_request_t*) t->data;
+    if (r == NULL) {
+        return false;
+    }
+    ngx_http_hi_loc_conf_t * conf = (ngx_http_hi_loc_conf_t *) ngx_http_get_module_loc_conf(r, ngx_http_hi_module);
+    if (conf->redis_index == NGX_CONF_UNSET) {
+        return false;
     }
+    hi::redis_async* conn = REDIS[conf->redis_index]->get_plain(cmd.size() > 1 ? cmd[1] : cmd[0]);
+    if (conn == NULL) {
+        return false;
+    }
+    ngx_http_hi_redis_wait_t *wait = new ngx_http_hi_redis_wait_t();
+    wait->r = r;
+    if (!conn->command(ngx_http_hi_lua_redis_handler, wait, cmd)) {
+        delete wait;
+        return false;
+    }
+    ngx_http_hi_redis_wait(r, (ngx_http_hi_ctx_t*) ngx_http_get_module_ctx(r, ngx_http_hi_module), wait, ngx_http_hi_lua_redis_timeout_handler);
+    t->pending = true;
+    return true;
 }
 
-static void ngx_http_hi_lua_handler(ngx_http_hi_loc_conf_t * conf, hi::request& req, hi::response& res) {
-    hi::py_request py_req;
-    hi::py_response py_res;
-    py_req.init(&req);
-    py_res.init(&res);
-    if (!LUA) {
-        LUA = std::make_shared<hi::lua>();
-    }
-    if (LUA) {
-        LUA->set_req(&py_req);
-        LUA->set_res(&py_res);
-        if (conf->lua_script.len > 0) {
-            LUA->call_script(std::string((char*) conf->lua_script.data, conf->lua_script.len).append(req.uri));
-        } else if (conf->lua_content.len > 0) {
-            LUA->call_content((char*) conf->lua_content.data);
-        }
-    }
-}
\ No newline at end of file
+/*
+ * hi.redis returns the reply, or nil and the error. Nothing is left to do
+ * when the request went away or timed out meanwhile.
+ */
+static void ngx_http_hi_lua_redis_handler(redisAsyncContext *ac, void *reply, void *privdata) {
+    ngx_http_hi_redis_wait_t *wait = (ngx_http_hi_redis_wait_t*) privdata;
+    ngx_http_request_t *r = wait->r;
+    delete wait;
+    if (r == NULL) {
+        return;
+    }
+    ngx_http_hi_ctx_t *ctx = (ngx_http_hi_ctx_t*) ngx_http_get_module_ctx(r, ngx_http_hi_module);
+    hi::lua::task *t = ctx->task;
+    redisReply *rep = (redisReply*) reply;
+    int n = 2;
+
+    ctx->redis_wait = 0;
+    ngx_http_hi_redis_unwait(ctx);
+    t->pending = false;
+    if (ac->data == NULL || rep == NULL) {
+        lua_pushnil(t->co);
+        lua_pushstring(t->co, "redis connection failed");
+    } else if (rep->type == REDIS_REPLY_ERROR) {
+        lua_pushnil(t->co);
+        lua_pushlstring(t->co, rep->str, rep->len);
+    } else {
+        n = ngx_http_hi_lua_push_reply(t->co, rep);
+    }
+    ngx_connection_t *c = r->connection;
+    ngx_http_hi_lua_resume(r, ctx, n);
+    ngx_http_run_posted_requests(c);
+}
+
+static void ngx_http_hi_lua_redis_timeout_handler(ngx_event_t *ev) {
+    ngx_http_request_t *r = (ngx_http_request_t*) ev->data;
+    ngx_connection_t *c = r->connection;
+    ngx_http_hi_ctx_t *ctx = (ngx_http_hi_ctx_t*) ngx_http_get_module_ctx(r, ngx_http_hi_module);
+
+    ngx_http_hi_redis_unwait(ctx);
+    ctx->task->pending = false;
+    lua_pushnil(ctx->task->co);
+    lua_pushliteral(ctx->task->co, "redis timed out");
+    ngx_http_hi_lua_resume(r, ctx, 2);
+    ngx_http_run_posted_requests(c);
+}
+
+static int ngx_http_hi_lua_push_reply(lua_State *L, redisReply *rep) {
+    switch (rep->type) {
+        case REDIS_REPLY_STRING:
+        case REDIS_REPLY_STATUS:
+        case REDIS_REPLY_ERROR:
+            lua_pushlstring(L, rep->str, rep->len);
+            break;
+        case REDIS_REPLY_INTEGER:
+            lua_pushnumber(L, (lua_Number) rep->integer);
+            break;
+        case REDIS_REPLY_ARRAY:
+            lua_createtable(L, (int) rep->elements, 0);
+            for (size_t i = 0; i < rep->elements; ++i) {
+                ngx_http_hi_lua_push_reply(L, rep->element[i]);
+                lua_rawseti(L, -2, (int) i + 1);
+            }
+            break;
+        default:
+            lua_pushnil(L);
+            break;
+    }
+    return 1;
+}
+
+/*
+ * The body of an in memory subrequest is only kept by upstream modules,
+ * proxy_pass, fastcgi_pass and the like, and has to fit in their buffer.
+ */
+bool ngx_http_hi_lua_io::subrequest(hi::lua::task* t, const std::string& uri, const std::string& args) {
+    ngx_http_request_t *r = (ngx_http_request_t*) t->data, *sr;
+    if (r == NULL || uri.empty()) {
+        return false;
+    }
+    ngx_http_post_subrequest_t *ps = (ngx_http_post_subrequest_t*) ngx_palloc(r->pool, sizeof (ngx_http_post_subrequest_t));
+    ngx_str_t *u = (ngx_str_t*) ngx_palloc(r->pool, sizeof (ngx_str_t) * 2), *a = u + 1;
+    if (ps == NULL || u == NULL) {
+        return false;
+    }
+    u->len = uri.size();
+    a->len = args.size();
+    if ((u->data = (u_char*) ngx_pnalloc(r->pool, u->len + a->len)) == NULL) {
+        return false;
+    }
+    a->data = ngx_cpymem(u->data, uri.data(), u->len);
+    ngx_memcpy(a->data, args.data(), a->len);
+    ps->handler = ngx_http_hi_lua_subrequest_done;
+    ps->data = t;
+    // a terminated subrequest never reaches its post_subrequest handler
+    ngx_http_cleanup_t *cln = ngx_http_cleanup_add(r, 0);
+    if (cln == NULL || ngx_http_subrequest(r, u, a->len > 0 ? a : NULL, &sr, ps, NGX_HTTP_SUBREQUEST_IN_MEMORY) != NGX_OK) {
+        return false;
+    }
+    cln->handler = ngx_http_hi_lua_subrequest_cleanup;
+    cln->data = t;
+    t->pending = true;
+    return true;
+}
+
+/*
+ * Runs before the request pool goes, so the ctx cleanup can release a task
+ * whose subrequest never finished.
+ */
+static void ngx_http_hi_lua_subrequest_cleanup(void *data) {
+    hi::lua::task *t = (hi::lua::task*) data;
+    t->pending = false;
+}
+
+// hi.subrequest returns the status and body, once the parent runs again
+static ngx_int_t ngx_http_hi_lua_subrequest_done(ngx_http_request_t *sr, void *data, ngx_int_t rc) {
+    hi::lua::task *t = (hi::lua::task*) data;
+    if (!t->pending) {
+        return rc;
+    }
+    t->pending = false;
+    ngx_int_t status = sr->headers_out.status;
+    if (status == 0) {
+        status = rc >= NGX_HTTP_OK ? rc : NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+    lua_pushinteger(t->co, (lua_Integer) status);
+    if (sr->upstream && sr->upstream->buffer.pos) {
+        lua_pushlstring(t->co, (const char*) sr->upstream->buffer.pos, sr->upstream->buffer.last - sr->upstream->buffer.pos);
+    } else {
+        lua_pushliteral(t->co, "");
+    }
+    sr->parent->write_event_handler = ngx_http_hi_lua_subrequest_handler;
+    return rc;
+}
+
+static void ngx_http_hi_lua_subrequest_handler(ngx_http_request_t *r) {
+    r->write_event_handler = ngx_http_request_empty_handler;
+    ngx_http_hi_lua_resume(r, (ngx_http_hi_ctx_t*) ngx_http_get_module_ctx(r, ngx_http_hi_module), 2);
+}
@@ -0,0 +1,193 @@
+/*
+ * Replays the URLs of an access log through lib/lrucache.hpp the way the
+ * module uses its cache, a find and on a miss a put weighed by the response
+ * size, once with the lru and once with the tinylfu policy, and prints the
+ * hit ratio for each hi_cache_max_bytes given.
+ *
+ *   g++ -std=c++11 -O2 tools/cache_replay.cpp -o cache_replay
+ *   ./cache_replay [-m 1,4,16,64] [-d 4096] [access.log]
+ *
+ * Lines in the combined format take the path from the request line and the
+ * size from $body_bytes_sent, any other line is read as a bare URL of -d
+ * bytes. -m lists the cache sizes in MB, the log is read from stdin when no
+ * file is given.
+ */
+
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include "../lib/hash.hpp"
+#include "../lib/lrucache.hpp"
+
+namespace {
+
+    struct request_t {
+        cache::key128 key;
+        size_t size;
+    };
+
+    struct entry_t {
+        size_t size = 0;
+    };
+
+    struct entry_weigher {
+
+        size_t operator()(const cache::key128& key, const entry_t& e) const {
+            return sizeof (key) + e.size;
+        }
+    };
+
+    typedef cache::lru_cache<cache::key128, entry_t, cache::key128_hash, std::equal_to<cache::key128>, entry_weigher> replay_cache_t;
+
+    // the path and the args are hashed apart like the module does for r->uri and r->args
+    cache::key128 url_key(const char* p, size_t len) {
+        const char* q = (const char*) memchr(p, '?', len);
+        size_t n = q ? q - p : len;
+        cache::key128 k = cache::hash128(p, n);
+        if (q && len > n + 1) {
+            k = cache::hash128(q + 1, len - n - 1, k);
+        }
+        return k;
+    }
+
+    bool parse_line(const std::string& line, size_t default_size, request_t& req) {
+        const char* p = line.c_str(), *e = p + line.size();
+        const char* open = strchr(p, '"');
+        req.size = default_size;
+        if (open == NULL) {
+            while (p < e && isspace((unsigned char) *p)) {
+                ++p;
+            }
+            const char* u = p;
+            while (u < e && !isspace((unsigned char) *u)) {
+                ++u;
+            }
+            if (u == p) {
+                return false;
+            }
+            req.key = url_key(p, u - p);
+            return true;
+        }
+        const char* close = strchr(open + 1, '"');
+        if (close == NULL) {
+            return false;
+        }
+        // "METHOD URL PROTOCOL"
+        const char* u = (const char*) memchr(open + 1, ' ', close - open - 1);
+        if (u == NULL) {
+            return false;
+        }
+        ++u;
+        const char* end = (const char*) memchr(u, ' ', close - u);
+        if (end == NULL) {
+            end = close;
+        }
+        if (end == u) {
+            return false;
+        }
+        req.key = url_key(u, end - u);
+        // " STATUS BYTES"
+        char* next;
+        strtoul(close + 1, &next, 10);
+        while (*next == ' ') {
+            ++next;
+        }
+        if (isdigit((unsigned char) *next)) {
+            req.size = strtoul(next, NULL, 10);
+        }
+        return true;
+    }
+
+    bool read_log(FILE* in, size_t default_size, std::vector<request_t>& trace) {
+        std::string line;
+        char buf[4096];
+        request_t req;
+        while (fgets(buf, sizeof (buf), in)) {
+            line += buf;
+            if (line.back() != '\n' && !feof(in)) {
+                continue;
+            }
+            if (parse_line(line, default_size, req)) {
+                trace.push_back(req);
+            }
+            line.clear();
+        }
+        return !ferror(in);
+    }
+
+    void replay(const std::vector<request_t>& trace, size_t mb, cache::policy_t policy) {
+        replay_cache_t cache(0, mb << 20, policy);
+        size_t hits = 0, hit_bytes = 0, bytes = 0;
+        for (const request_t& req : trace) {
+            bytes += req.size;
+            if (cache.find(req.key)) {
+                ++hits;
+                hit_bytes += req.size;
+                continue;
+            }
+            entry_t e;
+            e.size = req.size;
+            cache::key128 key = req.key;
+            cache.put(std::move(key), std::move(e));
+        }
+        double ratio = 100.0 * hits / trace.size();
+        printf("%6zu MB  %-8s %7.2f%%  %7.2f%%  %9.4f  %10zu\n", mb, policy == cache::lru ? "lru" : "tinylfu"
+                , ratio, bytes ? 100.0 * hit_bytes / bytes : 0.0, ratio / mb, cache.evictions());
+    }
+}
+
+int main(int argc, char** argv) {
+    std::vector<size_t> sizes;
+    size_t default_size = 4096;
+    int opt;
+    while ((opt = getopt(argc, argv, "m:d:")) != -1) {
+        switch (opt) {
+            case 'm':
+                for (char* p = optarg; *p;) {
+                    char* next;
+                    size_t mb = strtoul(p, &next, 10);
+                    if (next == p || mb == 0) {
+                        fprintf(stderr, "bad size list: %s\n", optarg);
+                        return 1;
+                    }
+                    sizes.push_back(mb);
+                    p = *next == ',' ? next + 1 : next;
+                }
+                break;
+            case 'd':
+                default_size = strtoul(optarg, NULL, 10);
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-m mb,...] [-d bytes] [access.log]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (sizes.empty()) {
+        sizes = {1, 4, 16, 64};
+    }
+    FILE* in = stdin;
+    if (optind < argc && (in = fopen(argv[optind], "r")) == NULL) {
+        perror(argv[optind]);
+        return 1;
+    }
+    std::vector<request_t> trace;
+    bool ok = read_log(in, default_size, trace);
+    if (in != stdin) {
+        fclose(in);
+    }
+    if (!ok || trace.empty()) {
+        fprintf(stderr, "no requests read\n");
+        return 1;
+    }
+    printf("%zu requests\n", trace.size());
+    printf("%9s  %-8s %8s  %8s  %9s  %10s\n", "size", "policy", "hits", "bytes", "hits/MB", "evictions");
+    for (size_t mb : sizes) {
+        replay(trace, mb, cache::lru);
+        replay(trace, mb, cache::tinylfu);
+    }
+    return 0;
+}
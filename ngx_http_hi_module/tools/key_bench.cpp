@@ -0,0 +1,129 @@
+/*
+ * Times the cache hit path of the module for both cache keys it has had: the
+ * md5 of uri?args hex-dumped into a 32 character std::string, and the
+ * cache::key128 of lib/hash.hpp hashed straight from uri and args. Each
+ * lookup builds the key and finds it in an lru_cache holding every key.
+ *
+ *   g++ -std=c++11 -O2 tools/key_bench.cpp -o key_bench -lcrypto
+ *   ./key_bench [rounds]
+ */
+
+#define OPENSSL_SUPPRESS_DEPRECATED
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+#include <openssl/md5.h>
+#include "../lib/hash.hpp"
+#include "../lib/lrucache.hpp"
+
+namespace {
+
+    struct entry_t {
+        int status = 200;
+        std::string header, content;
+    };
+
+    typedef std::pair<std::string, std::string> request_t;
+
+    std::string token(std::mt19937& rng, size_t n) {
+        static const char ALNUM[] = "abcdefghijklmnopqrstuvwxyz0123456789";
+        std::string s;
+        for (size_t i = 0; i < n; ++i) {
+            s.push_back(ALNUM[rng() % (sizeof (ALNUM) - 1)]);
+        }
+        return s;
+    }
+
+    // product and search pages, half of them with tracking parameters
+    request_t request(std::mt19937& rng) {
+        request_t req;
+        if (rng() % 2) {
+            req.first = "/shop/" + token(rng, 6) + "/item/" + std::to_string(rng() % 100000) + ".html";
+        } else {
+            req.first = "/search";
+            req.second = "q=" + token(rng, 4 + rng() % 8) + "&page=" + std::to_string(rng() % 20) + "&sort=price_asc";
+        }
+        if (rng() % 2) {
+            req.second += (req.second.empty() ? "" : "&") + std::string("utm_source=newsletter&utm_medium=email&utm_campaign=") + token(rng, 12);
+        }
+        return req;
+    }
+
+    // what ngx_http_hi_normal_handler did with ngx_md5 and ngx_hex_dump
+    std::string md5_key(const request_t& req) {
+        static const char hex[] = "0123456789abcdef";
+        std::string k(req.first);
+        if (!req.second.empty()) {
+            k.append("?").append(req.second);
+        }
+        unsigned char digest[16];
+        char buf[32];
+        MD5_CTX md5;
+        MD5_Init(&md5);
+        MD5_Update(&md5, k.c_str(), k.size());
+        MD5_Final(digest, &md5);
+        for (size_t i = 0; i < 16; ++i) {
+            buf[i * 2] = hex[digest[i] >> 4];
+            buf[i * 2 + 1] = hex[digest[i] & 15];
+        }
+        k.assign(buf, 32);
+        return k;
+    }
+
+    cache::key128 hash_key(const request_t& req) {
+        cache::key128 k = cache::hash128(req.first.data(), req.first.size());
+        if (!req.second.empty()) {
+            k = cache::hash128(req.second.data(), req.second.size(), k);
+        }
+        return k;
+    }
+
+    template<class F>
+    double run(const std::vector<request_t>& requests, size_t rounds, F fn, size_t& hits) {
+        auto start = std::chrono::steady_clock::now();
+        hits = 0;
+        for (size_t r = 0; r < rounds; ++r) {
+            for (const request_t& req : requests) {
+                hits += fn(req);
+            }
+        }
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+}
+
+int main(int argc, char** argv) {
+    size_t rounds = argc > 1 ? strtoul(argv[1], NULL, 10) : 100;
+    std::mt19937 rng(1);
+    std::vector<request_t> requests;
+    for (int i = 0; i < 10000; ++i) {
+        requests.push_back(request(rng));
+    }
+
+    cache::lru_cache<std::string, entry_t> md5_cache(requests.size());
+    cache::lru_cache<cache::key128, entry_t, cache::key128_hash> hash_cache(requests.size());
+    size_t bytes = 0;
+    for (const request_t& req : requests) {
+        md5_cache.put(md5_key(req), entry_t());
+        hash_cache.put(hash_key(req), entry_t());
+        bytes += req.first.size() + req.second.size();
+    }
+
+    size_t hits0, hits1;
+    double t0 = run(requests, rounds, [&](const request_t & req) {
+        return md5_cache.find(md5_key(req)) != NULL;
+    }, hits0);
+    double t1 = run(requests, rounds, [&](const request_t & req) {
+        return hash_cache.find(hash_key(req)) != NULL;
+    }, hits1);
+    double n = (double) requests.size() * rounds;
+    printf("%zu requests, %zu B uri and args avg\n", requests.size(), bytes / requests.size());
+    printf("md5 hex  %7.1f ns/lookup  (%zu hits)\n", t0 / n * 1e9, hits0);
+    printf("key128   %7.1f ns/lookup  (%zu hits)  %.2fx\n", t1 / n * 1e9, hits1, t0 / t1);
+    return 0;
+}
@@ -0,0 +1,173 @@
+/*
+ * Times lib/lrucache.hpp against the std::list and std::unordered_map
+ * lru_cache it replaced, both keyed by the 32 character strings the module
+ * used to cache under, at 10k and 1M entries: filling the cache, finding
+ * present and absent keys, and putting new keys that each evict one.
+ *
+ *   g++ -std=c++11 -O2 tools/lru_bench.cpp -o lru_bench
+ *   ./lru_bench [rounds]
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <chrono>
+#include <list>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "../lib/lrucache.hpp"
+
+namespace {
+
+    // the lru_cache before lib/lrucache.hpp became an intrusive container
+    template<typename key_t, typename value_t>
+    class list_lru_cache {
+    public:
+        typedef typename std::pair<key_t, value_t> key_value_pair_t;
+        typedef typename std::list<key_value_pair_t>::iterator list_iterator_t;
+
+        list_lru_cache(size_t max_size) :
+        _max_size(max_size) {
+        }
+
+        void put(const key_t& key, const value_t& value) {
+            auto it = _cache_items_map.find(key);
+            _cache_items_list.push_front(key_value_pair_t(key, value));
+            if (it != _cache_items_map.end()) {
+                _cache_items_list.erase(it->second);
+                _cache_items_map.erase(it);
+            }
+            _cache_items_map[key] = _cache_items_list.begin();
+
+            if (_cache_items_map.size() > _max_size) {
+                auto last = _cache_items_list.end();
+                last--;
+                _cache_items_map.erase(last->first);
+                _cache_items_list.pop_back();
+            }
+        }
+
+        const value_t& get(const key_t& key) {
+            auto it = _cache_items_map.find(key);
+            if (it == _cache_items_map.end()) {
+                throw std::range_error("There is no such key in cache");
+            } else {
+                _cache_items_list.splice(_cache_items_list.begin(), _cache_items_list, it->second);
+                return it->second->second;
+            }
+        }
+
+        bool exists(const key_t& key) const {
+            return _cache_items_map.find(key) != _cache_items_map.end();
+        }
+
+    private:
+        std::list<key_value_pair_t> _cache_items_list;
+        std::unordered_map<key_t, list_iterator_t> _cache_items_map;
+        size_t _max_size;
+    };
+
+    struct entry_t {
+        int status = 200;
+        time_t t = 0;
+        std::string header, content;
+    };
+
+    std::string key(size_t i) {
+        char buf[33];
+        snprintf(buf, sizeof (buf), "%016zx%016zx", (size_t) (i * 0x9e3779b97f4a7c15ULL), i);
+        return buf;
+    }
+
+    template<class F>
+    double run(F fn) {
+        auto start = std::chrono::steady_clock::now();
+        fn();
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    // the module looked a key up with exists and then get
+    struct list_ops {
+        list_lru_cache<std::string, entry_t> cache;
+
+        list_ops(size_t n) : cache(n) {
+        }
+
+        void put(const std::string& k) {
+            this->cache.put(k, entry_t());
+        }
+
+        const entry_t* find(const std::string& k) {
+            return this->cache.exists(k) ? &this->cache.get(k) : NULL;
+        }
+    };
+
+    struct intrusive_ops {
+        cache::lru_cache<std::string, entry_t> cache;
+
+        intrusive_ops(size_t n) : cache(n) {
+        }
+
+        void put(const std::string& k) {
+            this->cache.put(std::string(k), entry_t());
+        }
+
+        const entry_t* find(const std::string& k) {
+            return this->cache.find(k);
+        }
+    };
+
+    template<class C>
+    void report(const char* name, size_t n, size_t rounds, const std::vector<std::string>& keys, const std::vector<size_t>& order) {
+        double fill = 0, hit = 0, miss = 0, evict = 0;
+        size_t found = 0;
+        for (size_t r = 0; r < rounds; ++r) {
+            C c(n);
+            fill += run([&]() {
+                for (size_t i = 0; i < n; ++i) {
+                    c.put(keys[i]);
+                }
+            });
+            hit += run([&]() {
+                for (size_t i : order) {
+                    found += c.find(keys[i]) != NULL;
+                }
+            });
+            miss += run([&]() {
+                for (size_t i = n; i < 2 * n; ++i) {
+                    found += c.find(keys[i]) != NULL;
+                }
+            });
+            evict += run([&]() {
+                for (size_t i = n; i < 2 * n; ++i) {
+                    c.put(keys[i]);
+                }
+            });
+        }
+        double ops = (double) n * rounds / 1e6;
+        printf("%-9s %8zu  put %6.2f  find hit %6.2f  find miss %6.2f  put evicting %6.2f Mops/s  (%zu)\n", name, n
+                , ops / fill, ops / hit, ops / miss, ops / evict, found % 10);
+    }
+}
+
+int main(int argc, char** argv) {
+    size_t rounds = argc > 1 ? strtoul(argv[1], NULL, 10) : 3;
+    std::mt19937 rng(1);
+    for (size_t n : {(size_t) 10000, (size_t) 1000000}) {
+        std::vector<std::string> keys;
+        std::vector<size_t> order;
+        for (size_t i = 0; i < 2 * n; ++i) {
+            keys.push_back(key(i));
+        }
+        for (size_t i = 0; i < n; ++i) {
+            order.push_back(rng() % n);
+        }
+        size_t r = n < 100000 ? rounds * 100 : rounds;
+        report<list_ops>("list", n, r, keys, order);
+        report<intrusive_ops>("intrusive", n, r, keys, order);
+    }
+    return 0;
+}
@@ -0,0 +1,139 @@
+/*
+ * Times lib/param.hpp on query strings and cookie headers like the ones the
+ * module splits for every request, against the same parser with a plain
+ * byte loop in place of find_either. Query values are percent-decoded in
+ * both runs.
+ *
+ *   g++ -std=c++11 -O2 -march=native tools/param_bench.cpp -o param_bench
+ *   ./param_bench [rounds]
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <random>
+#include "../lib/param.hpp"
+
+namespace {
+
+    const char* find_either_bytes(const char* p, const char* e, char a, char b) {
+        for (; p != e; ++p) {
+            if (*p == a || *p == b) {
+                return p;
+            }
+        }
+        return e;
+    }
+
+    // split_param with find_either_bytes
+    template<class F>
+    void split_bytes(const hi::string_view& data, char sep, char eq, F fn) {
+        const char* p = data.begin(), *e = data.end();
+        while (p < e) {
+            const char* k = find_either_bytes(p, e, sep, eq);
+            if (k == e || *k == sep) {
+                p = k + 1;
+                continue;
+            }
+            const char* v = find_either_bytes(k + 1, e, sep, sep);
+            fn(hi::string_view(p, k - p), hi::string_view(k + 1, v - k - 1));
+            p = v + 1;
+        }
+    }
+
+    std::string token(std::mt19937& rng, size_t n, const char* alphabet) {
+        std::string s;
+        size_t m = strlen(alphabet);
+        for (size_t i = 0; i < n; ++i) {
+            s.push_back(alphabet[rng() % m]);
+        }
+        return s;
+    }
+
+    const char* ALNUM = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
+
+    // a search page with paging and tracking parameters
+    std::string query(std::mt19937& rng) {
+        std::string q = "q=" + token(rng, 4 + rng() % 8, ALNUM) + "+" + token(rng, 3 + rng() % 6, ALNUM)
+                + "&page=" + std::to_string(rng() % 50) + "&sort=price_asc";
+        if (rng() % 2) {
+            q += "&utm_source=newsletter&utm_medium=email&utm_campaign=" + token(rng, 12, ALNUM)
+                    + "&ref=https%3A%2F%2Fexample.com%2F" + token(rng, 10, ALNUM) + "%3Fid%3D" + std::to_string(rng());
+        }
+        return q;
+    }
+
+    // analytics, session and consent cookies, one of them a JWT
+    std::string cookie(std::mt19937& rng) {
+        return "_ga=GA1.2." + std::to_string(rng()) + "." + std::to_string(rng())
+                + "; _gid=GA1.2." + std::to_string(rng())
+                + "; SESSIONID=" + token(rng, 32, ALNUM)
+                + "; consent=analytics%3Dtrue%26ads%3Dfalse"
+                + "; token=" + token(rng, 36, ALNUM) + "." + token(rng, 120, ALNUM) + "." + token(rng, 43, ALNUM)
+                + "; lang=en-US; theme=dark";
+    }
+
+    template<class F>
+    double run(const std::vector<std::string>& inputs, size_t rounds, F fn, size_t& items) {
+        auto start = std::chrono::steady_clock::now();
+        items = 0;
+        for (size_t r = 0; r < rounds; ++r) {
+            for (const std::string& s : inputs) {
+                items += fn(s);
+            }
+        }
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    void report(const char* name, const std::vector<std::string>& inputs, size_t rounds, char sep, bool decode) {
+        size_t bytes = 0, items = 0, sink = 0;
+        for (const std::string& s : inputs) {
+            bytes += s.size();
+        }
+        bytes *= rounds;
+        std::vector<char> buf(4096);
+        auto parse = [&](bool simd) {
+            return [&, simd](const std::string & s) {
+                size_t n = 0;
+                auto fn = [&](const hi::string_view& key, const hi::string_view & value) {
+                    ++n;
+                    sink += decode ? hi::percent_decode(value.data(), value.size(), buf.data()) : value.size();
+                    sink += key.size();
+                };
+                if (simd) {
+                    hi::split_param(s, sep, '=', fn);
+                } else {
+                    split_bytes(s, sep, '=', fn);
+                }
+                return n;
+            };
+        };
+        double t0 = run(inputs, rounds, parse(false), items);
+        double t1 = run(inputs, rounds, parse(true), items);
+        printf("%-8s %6zu B avg  %5.1f items  byte loop %7.1f MB/s  find_either %7.1f MB/s  %.2fx  (%zu)\n", name
+                , bytes / rounds / inputs.size(), (double) items / rounds / inputs.size()
+                , bytes / t0 / 1e6, bytes / t1 / 1e6, t0 / t1, sink % 10);
+    }
+}
+
+int main(int argc, char** argv) {
+    size_t rounds = argc > 1 ? strtoul(argv[1], NULL, 10) : 200;
+    std::mt19937 rng(1);
+    std::vector<std::string> queries, cookies;
+    for (int i = 0; i < 10000; ++i) {
+        queries.push_back(query(rng));
+        cookies.push_back(cookie(rng));
+    }
+#if defined(__AVX2__)
+    printf("find_either: AVX2\n");
+#elif defined(__SSE2__)
+    printf("find_either: SSE2\n");
+#else
+    printf("find_either: byte loop\n");
+#endif
+    report("query", queries, rounds, '&', true);
+    report("cookie", cookies, rounds, ';', false);
+    return 0;
+}